@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../emulator/cpu.h"
+#include "manifest.h"
+
+namespace {
+    enum class Status {
+        pass,    // an exit condition held
+        done,    // budget spent, no conditions to check
+        timeout, // budget spent before any condition held
+        fault,   // the CPU stopped with an error
+        error    // the ROM could not be loaded
+    };
+
+    struct Result {
+        Status status;
+        uint64_t cycles;
+        uint64_t frames;
+        uint64_t framebuffer_hash;
+        std::string detail;
+    };
+
+    const char *to_string(Status status) {
+        switch (status) {
+            case Status::pass: return "pass";
+            case Status::done: return "done";
+            case Status::timeout: return "timeout";
+            case Status::fault: return "fault";
+            case Status::error: return "error";
+        }
+
+        return "unknown";
+    }
+
+    // FNV-1a over the 2-bit shades
+    uint64_t hash_framebuffer(const uint8_t *framebuffer) {
+        constexpr size_t size = emulator::PPU::width * emulator::PPU::height;
+        uint64_t hash = 0xcbf29ce484222325;
+
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ framebuffer[i]) * 0x100000001b3;
+        }
+
+        return hash;
+    }
+
+#ifdef GUB_PROFILE
+    // Writes PREFIX.prof (flat report) and PREFIX.folded (folded stacks)
+    void write_profile(
+        const std::string &prefix, const emulator::Profiler &profiler
+    ) {
+        std::ofstream report(prefix + ".prof");
+        std::ofstream folded(prefix + ".folded");
+
+        profiler.write_report(report);
+        profiler.write_folded(folded);
+    }
+#endif
+
+    /*
+     * Runs one job on its own Cartridge and CPU. Conditions are checked once
+     * per frame worth of cycles, which keeps the check out of the hot loop.
+     * Profiled builds also write the job's profile next to the results.
+     */
+    Result run_job(const batch::Job &job, const std::string &profile) {
+        using namespace emulator;
+
+        Result result{};
+
+        // Never write back to the save files of the ROMs under test
+        SaveOptions options;
+        options.mode = SaveOptions::Mode::copy_on_write;
+
+        auto cartridge = Cartridge::open(job.path.c_str(), options);
+
+        if (!cartridge) {
+            result.status = Status::error;
+            result.detail = to_string(cartridge.error());
+            return result;
+        }
+
+        // The bus and tile cache are too large for a worker's stack
+        auto cpu = std::make_unique<CPU>(*cartridge);
+        size_t serial_checked = 0;
+
+        // Nothing ever listens to batch runs
+        cpu->set_audio_enabled(false);
+        cpu->set_video_enabled(job.video);
+
+        result.status = job.has_conditions() ? Status::timeout : Status::done;
+
+        while (cpu->get_cycles() < job.cycles) {
+            auto ran = cpu->run(
+                std::min(batch::frame_cycles, job.cycles - cpu->get_cycles())
+            );
+
+            if (!ran) {
+                result.status = Status::fault;
+                result.detail = to_string(ran.error());
+                break;
+            }
+
+            if (job.memory &&
+                cpu->peek(job.memory->address) == job.memory->value) {
+                result.status = Status::pass;
+                result.detail = "mem";
+                break;
+            }
+
+            if (job.serial) {
+                auto &output = cpu->get_serial_output();
+
+                // Only rescan the tail that could hold a new match
+                auto from = serial_checked >= job.serial->size()
+                    ? serial_checked - job.serial->size() + 1
+                    : 0;
+
+                if (output.find(*job.serial, from) != std::string::npos) {
+                    result.status = Status::pass;
+                    result.detail = "serial";
+                    break;
+                }
+
+                serial_checked = output.size();
+            }
+
+            if (job.framebuffer_hash &&
+                hash_framebuffer(cpu->get_framebuffer()) ==
+                    *job.framebuffer_hash) {
+                result.status = Status::pass;
+                result.detail = "hash";
+                break;
+            }
+        }
+
+        result.cycles = cpu->get_cycles();
+        result.frames = cpu->get_frame_count();
+        result.framebuffer_hash = job.video
+            ? hash_framebuffer(cpu->get_framebuffer())
+            : 0;
+
+#ifdef GUB_PROFILE
+        write_profile(profile, cpu->get_profiler());
+#else
+        (void)profile;
+#endif
+
+        return result;
+    }
+
+    void write_results(
+        std::ostream &out, const std::vector<batch::Job> &jobs,
+        const std::vector<Result> &results
+    ) {
+        out << "rom\tstatus\tframes\tcycles\thash\tdetail\n";
+
+        for (size_t i = 0; i < jobs.size(); i++) {
+            auto &result = results[i];
+
+            out << jobs[i].path << '\t' << to_string(result.status) << '\t'
+                << result.frames << '\t' << result.cycles << '\t' << "0x"
+                << std::hex << std::setw(16) << std::setfill('0')
+                << result.framebuffer_hash << std::dec << '\t'
+                << result.detail << '\n';
+        }
+    }
+
+    void usage(const char *program) {
+        std::cerr << "usage: " << program
+                  << " MANIFEST RESULTS [-j THREADS]\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && !(argc == 5 && std::strcmp(argv[3], "-j") == 0)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (argc == 5) {
+        auto end = argv[4] + std::strlen(argv[4]);
+        auto [ptr, error] = std::from_chars(argv[4], end, threads);
+
+        if (error != std::errc() || ptr != end || threads == 0) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    auto jobs = batch::read_manifest(argv[1]);
+
+    if (!jobs) {
+        std::cerr << jobs.error() << '\n';
+        return 2;
+    }
+
+    std::ofstream out(argv[2]);
+
+    if (!out) {
+        std::cerr << "cannot open " << argv[2] << '\n';
+        return 2;
+    }
+
+    /*
+     * Workers share nothing but the job counter; each writes only its own
+     * slots of results, which are read after every worker has joined.
+     */
+    std::vector<Result> results(jobs->size());
+    std::atomic<size_t> next = 0;
+    std::vector<std::jthread> workers;
+
+    threads = std::min(threads, jobs->size());
+
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&] {
+            for (size_t job; (job = next.fetch_add(1)) < jobs->size();) {
+                results[job] = run_job(
+                    (*jobs)[job],
+                    std::string(argv[2]) + '.' + std::to_string(job)
+                );
+            }
+        });
+    }
+
+    workers.clear();
+
+    write_results(out, *jobs, results);
+
+    size_t failed = std::count_if(
+        results.begin(), results.end(),
+        [](const Result &result) {
+            return result.status != Status::pass &&
+                result.status != Status::done;
+        }
+    );
+
+    std::cout << results.size() - failed << '/' << results.size()
+              << " passed\n";
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+#include <cctype>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+
+#include "manifest.h"
+
+namespace batch {
+    namespace {
+        bool parse_number(std::string_view text, uint64_t &value) {
+            int base = 10;
+
+            if (text.starts_with("0x") || text.starts_with("0X")) {
+                text.remove_prefix(2);
+                base = 16;
+            }
+
+            auto end = text.data() + text.size();
+            auto [ptr, error] = std::from_chars(text.data(), end, value, base);
+
+            return !text.empty() && error == std::errc() && ptr == end;
+        }
+
+        /*
+         * Splits a line on whitespace. Double quotes group a value containing
+         * spaces and understand the \n, \" and \\ escapes.
+         */
+        std::expected<std::vector<std::string>, std::string> tokenize(
+            std::string_view line
+        ) {
+            std::vector<std::string> tokens;
+            size_t i = 0;
+
+            while (true) {
+                while (i < line.size() && std::isspace(line[i])) {
+                    i++;
+                }
+
+                if (i == line.size()) {
+                    return tokens;
+                }
+
+                std::string token;
+                bool quoted = false;
+
+                for (; i < line.size(); i++) {
+                    char c = line[i];
+
+                    if (!quoted && std::isspace(c)) {
+                        break;
+                    } else if (c == '"') {
+                        quoted = !quoted;
+                    } else if (quoted && c == '\\' && i + 1 < line.size()) {
+                        c = line[++i];
+                        token.push_back(c == 'n' ? '\n' : c);
+                    } else {
+                        token.push_back(c);
+                    }
+                }
+
+                if (quoted) {
+                    return std::unexpected("unterminated quote");
+                }
+
+                tokens.push_back(std::move(token));
+            }
+        }
+
+        std::expected<Job, std::string> parse_job(
+            const std::vector<std::string> &tokens,
+            const std::filesystem::path &directory
+        ) {
+            Job job{};
+            std::optional<uint64_t> frames;
+            std::optional<uint64_t> cycles;
+
+            job.path = (directory / tokens[0]).string();
+            job.video = true;
+
+            for (size_t i = 1; i < tokens.size(); i++) {
+                auto &token = tokens[i];
+                auto separator = token.find('=');
+
+                if (separator == std::string::npos) {
+                    return std::unexpected("expected key=value, got " + token);
+                }
+
+                auto key = std::string_view(token).substr(0, separator);
+                auto value = std::string_view(token).substr(separator + 1);
+                uint64_t number;
+
+                if (key == "frames" || key == "cycles") {
+                    if (!parse_number(value, number)) {
+                        return std::unexpected("invalid " + std::string(key));
+                    }
+
+                    (key == "frames" ? frames : cycles) = number;
+                } else if (key == "mem") {
+                    auto colon = value.find(':');
+                    uint64_t address;
+
+                    if (colon == std::string_view::npos ||
+                        !parse_number(value.substr(0, colon), address) ||
+                        !parse_number(value.substr(colon + 1), number) ||
+                        address > 0xffff || number > 0xff) {
+                        return std::unexpected("invalid mem condition");
+                    }
+
+                    job.memory = Job::MemoryCondition{
+                        static_cast<uint16_t>(address),
+                        static_cast<uint8_t>(number)
+                    };
+                } else if (key == "serial") {
+                    if (value.empty()) {
+                        return std::unexpected("empty serial condition");
+                    }
+
+                    job.serial = std::string(value);
+                } else if (key == "hash") {
+                    if (!parse_number(value, number)) {
+                        return std::unexpected("invalid hash condition");
+                    }
+
+                    job.framebuffer_hash = number;
+                } else if (key == "video") {
+                    if (value != "on" && value != "off") {
+                        return std::unexpected("invalid video setting");
+                    }
+
+                    job.video = value == "on";
+                } else {
+                    return std::unexpected("unknown key " + std::string(key));
+                }
+            }
+
+            if (frames.has_value() == cycles.has_value()) {
+                return std::unexpected("expected exactly one of frames/cycles");
+            }
+
+            if (job.framebuffer_hash && !job.video) {
+                return std::unexpected("hash condition needs video=on");
+            }
+
+            job.cycles = cycles ? *cycles : *frames * frame_cycles;
+
+            return job;
+        }
+    }
+
+    bool Job::has_conditions() const {
+        return memory || serial || framebuffer_hash;
+    }
+
+    std::expected<std::vector<Job>, std::string> read_manifest(
+        const std::string &path
+    ) {
+        std::ifstream file(path);
+
+        if (!file) {
+            return std::unexpected("cannot open " + path);
+        }
+
+        auto directory = std::filesystem::path(path).parent_path();
+        std::vector<Job> jobs;
+        std::string line;
+
+        for (size_t number = 1; std::getline(file, line); number++) {
+            auto where = path + ":" + std::to_string(number) + ": ";
+            auto tokens = tokenize(line);
+
+            if (!tokens) {
+                return std::unexpected(where + tokens.error());
+            }
+
+            if (tokens->empty() || (*tokens)[0].starts_with('#')) {
+                continue;
+            }
+
+            auto job = parse_job(*tokens, directory);
+
+            if (!job) {
+                return std::unexpected(where + job.error());
+            }
+
+            jobs.push_back(std::move(*job));
+        }
+
+        return jobs;
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace batch {
+    // Cycles in one LCD frame, the granularity budgets and conditions use
+    constexpr uint64_t frame_cycles = 70224;
+
+    /*
+     * One ROM to run. The run stops as soon as any of the exit conditions
+     * holds, or when the budget is exhausted.
+     */
+    struct Job {
+        struct MemoryCondition {
+            uint16_t address;
+            uint8_t value;
+        };
+
+        std::string path;
+        uint64_t cycles;
+
+        std::optional<MemoryCondition> memory;
+        std::optional<std::string> serial;
+        std::optional<uint64_t> framebuffer_hash;
+
+        // Whether lines are drawn at all; off skips the PPU entirely
+        bool video;
+
+        bool has_conditions() const;
+    };
+
+    /*
+     * Reads a manifest. Each non-empty line not starting with '#' is a ROM
+     * path followed by key=value options:
+     *  - frames=N or cycles=N: budget (exactly one is required);
+     *  - mem=ADDRESS:VALUE: stop once the byte at ADDRESS equals VALUE;
+     *  - serial="TEXT": stop once TEXT appears in the serial output;
+     *  - hash=HASH: stop once the framebuffer hash equals HASH;
+     *  - video=off: don't draw, for runs that only check memory or serial
+     *    output (video=on is the default).
+     * Numbers take a 0x prefix for hex. Relative ROM paths are resolved
+     * against the manifest's directory.
+     */
+    std::expected<std::vector<Job>, std::string> read_manifest(
+        const std::string &path
+    );
+}
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../emulator/bus.h"
+#include "../emulator/cpu.h"
+#include "../emulator/ppu.h"
+#include "../emulator/sync.h"
+#include "../emulator/tile_cache.h"
+#include "roms.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // Inputs are seeded the same way on every run
+    constexpr unsigned seed = 0x6b;
+    constexpr uint64_t frame_cycles = 70224;
+
+    size_t repeats = 5;
+
+    // Keeps the optimizer from dropping reads whose values go unused
+    volatile uint64_t sink;
+
+    /*
+     * Runs body repeats times and reports the fastest run, which is the one
+     * least disturbed by the rest of the system. body returns how many units
+     * of work it did.
+     */
+    template <typename Body>
+    void measure(const std::string &name, const char *unit, Body &&body) {
+        double best = 0;
+        uint64_t count = 0;
+
+        for (size_t i = 0; i < repeats; i++) {
+            auto start = Clock::now();
+            count = body();
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+
+            if (i == 0 || elapsed.count() < best) {
+                best = elapsed.count();
+            }
+        }
+
+        std::cout << name << '\t' << count << '\t' << std::fixed
+                  << std::setprecision(6) << best << '\t'
+                  << std::setprecision(0) << count / best << '\t' << unit
+                  << '\n';
+    }
+
+    void fail(const std::string &name, emulator::GameBoyError error) {
+        std::cerr << name << ": " << emulator::to_string(error) << '\n';
+    }
+
+    /*
+     * Instructions per second for each mix. Instruction counts come from
+     * the mix's average cost, taken by stepping one instruction at a time,
+     * so they stay right whatever each instruction costs.
+     */
+    void bench_cpu() {
+        using namespace emulator;
+
+        constexpr uint64_t calibration_steps = 100000;
+        constexpr uint64_t cycles = 64 * 1024 * 1024;
+
+        for (auto &mix : bench::get_mixes()) {
+            auto name = std::string("cpu/") + mix.name;
+            auto cartridge = bench::open_rom(bench::build_rom(mix));
+
+            if (!cartridge) {
+                fail(name, cartridge.error());
+                continue;
+            }
+
+            auto calibration = std::make_unique<CPU>(*cartridge);
+
+            for (uint64_t i = 0; i < calibration_steps; i++) {
+                (void)calibration->step();
+            }
+
+            double instruction_cycles =
+                double(calibration->get_cycles()) / calibration_steps;
+            auto cpu = std::make_unique<CPU>(*cartridge);
+
+            measure(name, "instructions/s", [&] {
+                if (auto ran = cpu->run(cycles); !ran) {
+                    fail(name, ran.error());
+                }
+
+                return uint64_t(cycles / instruction_cycles);
+            });
+        }
+    }
+
+    /*
+     * Accesses per second through Bus::read and Bus::write, walking each
+     * region in order. VRAM writes are split because tile data takes the
+     * slow path to keep the tile cache coherent.
+     */
+    void bench_bus() {
+        using namespace emulator;
+
+        struct Region {
+            const char *name;
+            uint16_t start;
+            uint16_t size;
+            bool write;
+        };
+
+        static constexpr Region regions[] = {
+            { "rom0", 0x0000, 0x4000, false },
+            { "romx", 0x4000, 0x4000, false },
+            { "vram", 0x8000, 0x2000, false },
+            { "cartridge_ram", 0xa000, 0x2000, false },
+            { "wram", 0xc000, 0x2000, false },
+            { "oam", 0xfe00, 0xa0, false },
+            { "io", 0xff40, 0x0c, false },
+            { "hram", 0xff80, 0x7f, false },
+            { "vram_tiles", 0x8000, 0x1800, true },
+            { "vram_maps", 0x9800, 0x800, true },
+            { "cartridge_ram", 0xa000, 0x2000, true },
+            { "wram", 0xc000, 0x2000, true },
+            { "oam", 0xfe00, 0xa0, true },
+            { "io", 0xff42, 0x02, true },
+            { "hram", 0xff80, 0x7f, true }
+        };
+
+        constexpr uint64_t accesses = 16 * 1024 * 1024;
+
+        auto cartridge = bench::open_rom(
+            bench::build_rom(bench::get_mixes().front(), true)
+        );
+
+        if (!cartridge) {
+            fail("bus", cartridge.error());
+            return;
+        }
+
+        Synchronizer sync;
+        auto bus = std::make_unique<Bus>(*cartridge, sync, ExternalMemory{});
+
+        // Enable cartridge RAM
+        bus->write(0x0000, 0x0a);
+
+        for (auto &region : regions) {
+            auto name = std::string(region.write ? "bus/write/" : "bus/read/") +
+                region.name;
+
+            measure(name, "accesses/s", [&] {
+                uint64_t sum = 0;
+                uint16_t offset = 0;
+
+                for (uint64_t i = 0; i < accesses; i++) {
+                    uint16_t address = region.start + offset;
+
+                    if (region.write) {
+                        bus->write(address, i);
+                    } else {
+                        sum += bus->read(address);
+                    }
+
+                    if (++offset == region.size) {
+                        offset = 0;
+                    }
+                }
+
+                sink = sum;
+
+                return accesses;
+            });
+        }
+    }
+
+    // Tile decoding and whole-line rendering over random VRAM and OAM
+    void bench_ppu() {
+        using namespace emulator;
+
+        constexpr size_t decodes = 4096;
+        constexpr size_t frames = 1024;
+
+        std::mt19937 random(seed);
+        std::vector<uint8_t> vram(0x2000);
+        std::vector<uint8_t> oam(160);
+
+        std::generate(vram.begin(), vram.end(), random);
+
+        // Keep every sprite on screen so lines have some to draw
+        for (size_t i = 0; i < oam.size(); i += 4) {
+            oam[i] = 16 + random() % 144;
+            oam[i + 1] = 8 + random() % 160;
+            oam[i + 2] = random();
+            oam[i + 3] = random() & 0xf0;
+        }
+
+        auto tiles = std::make_unique<TileCache>(vram.data());
+
+        measure("ppu/tile_decode", "tiles/s", [&] {
+            for (size_t i = 0; i < decodes; i++) {
+                tiles->invalidate_all();
+                tiles->refresh();
+            }
+
+            return uint64_t(decodes * TileCache::num_tiles);
+        });
+
+        PPU ppu(vram.data(), oam.data(), *tiles);
+        PPU::Registers registers{
+            .lcdc = 0xf7, .scy = 0, .scx = 0, .bgp = 0xe4, .obp0 = 0xd2,
+            .obp1 = 0x1b, .wy = 72, .wx = 87
+        };
+
+        measure("ppu/scanline", "lines/s", [&] {
+            for (size_t frame = 0; frame < frames; frame++) {
+                registers.scx = frame;
+                registers.scy = frame * 3;
+                ppu.start_frame();
+
+                for (uint8_t ly = 0; ly < PPU::height; ly++) {
+                    ppu.render_line(registers, ly);
+                }
+            }
+
+            return uint64_t(frames * PPU::height);
+        });
+    }
+
+    // Emulated frames per second on a whole machine
+    void bench_frames(const std::string &name, emulator::Cartridge &cartridge) {
+        using namespace emulator;
+
+        constexpr uint64_t frames = 600;
+
+        auto cpu = std::make_unique<CPU>(cartridge);
+
+        measure(name, "frames/s", [&] {
+            auto first = cpu->get_frame_count();
+
+            if (auto ran = cpu->run(frames * frame_cycles); !ran) {
+                fail(name, ran.error());
+            }
+
+            return cpu->get_frame_count() - first;
+        });
+    }
+
+    void usage(const char *program) {
+        std::cerr << "usage: " << program << " [-r REPEATS] [ROM...]\n";
+    }
+}
+
+/*
+ * Prints one tab-separated line per benchmark: name, units of work done,
+ * seconds taken by the fastest repeat, units per second and the unit. ROMs
+ * given on the command line are benchmarked as frames/PATH.
+ */
+int main(int argc, char **argv) {
+    int arg = 1;
+
+    if (argc > 2 && std::strcmp(argv[1], "-r") == 0) {
+        auto end = argv[2] + std::strlen(argv[2]);
+        auto [ptr, error] = std::from_chars(argv[2], end, repeats);
+
+        if (error != std::errc() || ptr != end || repeats == 0) {
+            usage(argv[0]);
+            return 2;
+        }
+
+        arg = 3;
+    }
+
+    std::cout << "benchmark\tcount\tseconds\trate\tunit\n";
+
+    bench_cpu();
+    bench_bus();
+    bench_ppu();
+
+    for (auto &program : bench::get_frame_programs()) {
+        auto name = std::string("frames/") + program.name;
+        auto cartridge = bench::open_rom(bench::build_rom(program));
+
+        if (!cartridge) {
+            fail(name, cartridge.error());
+            continue;
+        }
+
+        bench_frames(name, *cartridge);
+    }
+
+    for (; arg < argc; arg++) {
+        auto name = std::string("frames/") + argv[arg];
+
+        emulator::SaveOptions options;
+        options.mode = emulator::SaveOptions::Mode::copy_on_write;
+
+        auto cartridge = emulator::Cartridge::open(argv[arg], options);
+
+        if (!cartridge) {
+            fail(name, cartridge.error());
+            continue;
+        }
+
+        bench_frames(name, *cartridge);
+    }
+
+    return 0;
+}
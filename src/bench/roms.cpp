@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+#include "roms.h"
+
+namespace bench {
+    namespace {
+        constexpr uint16_t entry_point = 0x0150;
+        constexpr size_t unroll = 4;
+    }
+
+    const std::vector<Program> &get_mixes() {
+        static const std::vector<Program> mixes = {
+            // inc, add, xor, dec, and, or, sub, adc, sbc, cp, rotates, daa
+            { "alu", {}, {
+                0x04, 0x80, 0xa9, 0x15, 0xa3, 0xb4, 0x95, 0x88,
+                0x99, 0xba, 0x0c, 0x07, 0x2f, 0x37, 0x3f, 0x27
+            } },
+            // Register moves, (hl) and (hl+/-), absolute and high RAM
+            { "load", { 0x21, 0x00, 0xc0 }, {
+                0x47, 0x48, 0x77, 0x7e, 0x5e, 0x73, 0x22, 0x3a,
+                0x16, 0x12, 0xea, 0x00, 0xc1, 0xfa, 0x01, 0xc1,
+                0xe0, 0x80, 0xf0, 0x81, 0x2e, 0x00
+            } },
+            // Taken and untaken relative jumps
+            { "branch", {}, {
+                0x05, 0x28, 0x01, 0x00, 0x0c, 0x20, 0x00, 0x3d,
+                0x30, 0x00, 0x18, 0x00
+            } },
+            // Rotates, swap, bit, set and res, including (hl)
+            { "cb", { 0x21, 0x00, 0xc0 }, {
+                0xcb, 0x00, 0xcb, 0x19, 0xcb, 0x37, 0xcb, 0x7a,
+                0xcb, 0xc2, 0xcb, 0x83, 0xcb, 0x46, 0xcb, 0x26,
+                0xcb, 0x3f
+            } },
+            // push, pop, call and ret
+            { "stack", { 0x31, 0xfe, 0xff }, {
+                0xc5, 0xd5, 0xd1, 0xc1, 0xcd, 0x00, 0x10, 0xe5,
+                0xe1, 0xcd, 0x00, 0x10, 0xf5, 0xf1
+            } }
+        };
+
+        return mixes;
+    }
+
+    const std::vector<Program> &get_frame_programs() {
+        static const std::vector<Program> programs = {
+            /*
+             * Keeps rewriting tile data and scrolling, so every line
+             * decodes tiles again and goes through the IO slow path.
+             */
+            { "vram_scroll", { 0x21, 0x00, 0x80 }, {
+                0x7d, 0x22, 0xf0, 0x43, 0x3c, 0xe0, 0x43, 0x7c,
+                0xfe, 0x98, 0x20, 0x02, 0x26, 0x80
+            } },
+            // Waits for LY like a game idling between frames
+            { "poll_ly", { 0x21, 0x00, 0xc0 }, {
+                0xf0, 0x44, 0xfe, 0x90, 0x20, 0xfa, 0x34, 0xf0,
+                0x44, 0xfe, 0x91, 0x20, 0xfa, 0x34
+            } }
+        };
+
+        return programs;
+    }
+
+    std::vector<uint8_t> build_rom(const Program &program, bool mbc1) {
+        std::vector<uint8_t> image(0x8000);
+        auto out = image.begin() + entry_point;
+
+        // nop; jp entry_point
+        image[0x100] = 0x00;
+        image[0x101] = 0xc3;
+        image[0x102] = entry_point & 0xff;
+        image[0x103] = entry_point >> 8;
+        image[0x147] = mbc1 ? 0x02 : 0x00;
+        image[0x149] = mbc1 ? 0x02 : 0x00;
+
+        out = std::copy(program.init.begin(), program.init.end(), out);
+
+        uint16_t loop = out - image.begin();
+
+        for (size_t i = 0; i < unroll; i++) {
+            out = std::copy(program.body.begin(), program.body.end(), out);
+        }
+
+        // jp loop
+        *out++ = 0xc3;
+        *out++ = loop & 0xff;
+        *out++ = loop >> 8;
+
+        image[subroutine_address] = 0x3c;
+        image[subroutine_address + 1] = 0xc9;
+
+        return image;
+    }
+
+    std::expected<emulator::Cartridge, emulator::GameBoyError> open_rom(
+        const std::vector<uint8_t> &image
+    ) {
+        static std::atomic<unsigned> count = 0;
+
+        auto path = std::filesystem::temp_directory_path() / (
+            "gub-bench-" + std::to_string(getpid()) + '-' +
+            std::to_string(count++) + ".gb"
+        );
+
+        {
+            std::ofstream file(path, std::ios::binary);
+
+            file.write(
+                reinterpret_cast<const char *>(image.data()), image.size()
+            );
+
+            if (!file) {
+                return std::unexpected(emulator::GameBoyError::io_error);
+            }
+        }
+
+        emulator::SaveOptions options;
+        options.mode = emulator::SaveOptions::Mode::copy_on_write;
+
+        auto cartridge = emulator::Cartridge::open(path.c_str(), options);
+
+        std::filesystem::remove(path);
+
+        return cartridge;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <string>
+#include <vector>
+
+#include "../emulator/cartridge.hpp"
+
+namespace bench {
+    /*
+     * Synthetic workload: init runs once, then body loops forever. Every
+     * opcode used is one the core implements, so runs never fault.
+     */
+    struct Program {
+        const char *name;
+        std::vector<uint8_t> init;
+        std::vector<uint8_t> body;
+    };
+
+    // Instruction mixes for the CPU benchmarks
+    const std::vector<Program> &get_mixes();
+    // Programs exercising the LCD for the frame benchmarks
+    const std::vector<Program> &get_frame_programs();
+
+    // Holds "inc a; ret" for the mixes to call
+    constexpr uint16_t subroutine_address = 0x1000;
+
+    /*
+     * Builds a 32 KiB image running program, with the body unrolled a few
+     * times so blocks see realistic straight-line runs. mbc1 makes it an
+     * MBC1 cartridge with 8 KiB of RAM instead of a plain ROM.
+     */
+    std::vector<uint8_t> build_rom(const Program &program, bool mbc1 = false);
+
+    /*
+     * Opens an image as a cartridge. The image goes through a temporary
+     * file, which is removed as soon as it's mapped.
+     */
+    std::expected<emulator::Cartridge, emulator::GameBoyError> open_rom(
+        const std::vector<uint8_t> &image
+    );
+}
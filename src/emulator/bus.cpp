@@ -1,58 +1,532 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
 #include "bus.h"
 
 namespace emulator {
-    uint8_t Bus::read(uint16_t address) {
-        if (address < 0x4000) { // ROM bank 0
-            return cartridge.read_rom(address);
-        } else if (address < 0x8000) { // ROM bank 1-n
-            // CGB: implement bank switching
+    namespace {
+        // KEY1, VBK, HDMA1-HDMA5 and SVBK
+        bool is_cgb_register(uint16_t address) {
+            return address == 0xff4d || address == 0xff4f ||
+                (address >= 0xff51 && address <= 0xff55) || address == 0xff70;
+        }
+    }
+
+    Bus::Bus(
+        Cartridge &cartridge, Synchronizer &sync, const ExternalMemory &memory
+    ) : cgb(cartridge.supports_cgb()), vram{},
+        owned_wram(
+            memory.wram ? nullptr : std::make_unique<uint8_t[]>(wram_size)
+        ),
+        wram(memory.wram ? memory.wram : owned_wram.get()), oam{}, hram{},
+        vram_dirty{}, wram_dirty{}, tiles(vram.data()),
+        cartridge(cartridge), sync(sync),
+        io(sync, vram.data(), oam.data(), tiles, memory.framebuffer, cgb),
+        read_pages{}, write_pages{}, write_dirty{}, accurate_oam_dma(false),
+        oam_dma_active(false), vram_bank(0), wram_bank(1),
+        speed_switch_armed(false), hdma_source(0), hdma_dest(0),
+        hdma_length(0xff), hdma_active(false), watched_code(0),
+        written_code(0) {
+        map_memory();
+
+        if (cartridge.get_sync_interval()) {
+            sync.set_next_event(
+                Synchronizer::Module::cartridge,
+                sync.get_now() + cartridge.get_sync_interval()
+            );
+        }
+    }
+
+    void Bus::map(
+        uint16_t start, size_t size, const uint8_t *read, uint8_t *write,
+        uint8_t *dirty
+    ) {
+        auto first = start / page_size;
+
+        for (size_t i = 0; i < size / page_size; i++) {
+            read_pages[first + i] = read ? read + i * page_size : nullptr;
+            write_pages[first + i] = write ? write + i * page_size : nullptr;
+            write_dirty[first + i] = write ? dirty + i : nullptr;
+        }
+    }
+
+    /*
+     * Rebuilds the whole page table. While an accurate OAM DMA transfer
+     * runs, everything below the IO registers is left to the slow path,
+     * which blocks it.
+     */
+    void Bus::map_memory() {
+        if (oam_dma_active) {
+            map(0x0000, 0xff00, nullptr, nullptr, nullptr);
+            return;
+        }
+
+        auto vram_base = vram_bank * vram_bank_size;
+        auto wram_base = wram_bank * wram_bank_size;
+
+        // Tile data writes take the slow path to invalidate the tile cache
+        map(0x8000, vram_bank_size, vram.data() + vram_base, nullptr, nullptr);
+        map(
+            0x9800, 0x800, vram.data() + vram_base + 0x1800,
+            vram.data() + vram_base + 0x1800,
+            vram_dirty.data() + vram_base / page_size + 0x18
+        );
+        map(0xc000, wram_bank_size, wram, wram, wram_dirty.data());
+        map(
+            0xd000, wram_bank_size, wram + wram_base, wram + wram_base,
+            wram_dirty.data() + wram_base / page_size
+        );
+        // Echo RAM, up to the split page holding OAM
+        map(0xe000, wram_bank_size, wram, wram, wram_dirty.data());
+        map(
+            0xf000, 0xe00, wram + wram_base, wram + wram_base,
+            wram_dirty.data() + wram_base / page_size
+        );
+        remap_cartridge();
+
+        for (size_t page = 0; page < 2 * wram_bank_size / page_size; page++) {
+            if (watched_code & (1u << page)) {
+                unmap_wram_writes(page);
+            }
+        }
+    }
+
+    // Sends writes to a WRAM page of the CPU's view and its echo slow
+    void Bus::unmap_wram_writes(size_t page) {
+        write_pages[0xc0 + page] = nullptr;
+
+        if (0xe0 + page < 0xfe) {
+            write_pages[0xe0 + page] = nullptr;
+        }
+    }
+
+    /*
+     * Called whenever the MBC may have switched banks. ROM is never mapped
+     * for writes, since those hit the MBC registers.
+     */
+    void Bus::remap_cartridge() {
+        auto ram = cartridge.get_ram_bank();
+
+        map(0x0000, 0x4000, cartridge.get_rom_bank0(), nullptr, nullptr);
+        map(0x4000, 0x4000, cartridge.get_rom_bankn(), nullptr, nullptr);
+        map(0xa000, 0x2000, ram, ram, cartridge.get_ram_bank_dirty());
+    }
+
+    const uint8_t *Bus::get_palettes() const {
+        return io.get_palettes();
+    }
+
+    const uint8_t *Bus::get_framebuffer() const {
+        return io.get_framebuffer();
+    }
+
+    uint64_t Bus::get_frame_count() const {
+        return io.get_frame_count();
+    }
+
+    const std::string &Bus::get_serial_output() const {
+        return io.get_serial_output();
+    }
+
+    void Bus::set_buttons(uint8_t pressed) {
+        io.set_buttons(pressed);
+    }
+
+#ifdef GUB_PROFILE
+    uint32_t Bus::get_location(uint16_t address) const {
+        if (address >= 0x8000) {
+            return address;
+        }
+
+        return cartridge.get_rom_bank(address) << 16 | address;
+    }
+#endif
+
+    void Bus::set_sample_rate(uint32_t rate) {
+        io.set_sample_rate(rate);
+    }
+
+    SampleRing &Bus::get_samples() {
+        return io.get_samples();
+    }
+
+    void Bus::set_video_enabled(bool enabled) {
+        io.set_video_enabled(enabled);
+    }
+
+    void Bus::set_audio_enabled(bool enabled) {
+        io.set_audio_enabled(enabled);
+    }
+
+    void Bus::set_accurate_oam_dma(bool enabled) {
+        accurate_oam_dma = enabled;
+    }
+
+    /*
+     * Nothing but the CPU could write the source during the transfer, and
+     * in accurate mode it can't either, so all 160 bytes are copied at once,
+     * straight from host memory when the source page is mapped. What
+     * accurate mode adds is the window during which the CPU can't reach
+     * the rest of the bus.
+     */
+    void Bus::start_oam_dma(uint8_t page) {
+        // Sources past WRAM read its echo
+        if (page >= 0xe0) {
+            page -= 0x20;
+        }
+
+        // A new transfer restarts one already running
+        if (oam_dma_active) {
+            oam_dma_active = false;
+            map_memory();
+        }
+
+        if (auto source = read_pages[page]) {
+            std::memcpy(oam.data(), source, oam.size());
+        } else {
+            for (size_t i = 0; i < oam.size(); i++) {
+                oam[i] = read_slow(page << 8 | i);
+            }
+        }
+
+        if (accurate_oam_dma) {
+            oam_dma_active = true;
+            map_memory();
+            sync.set_next_event(
+                Synchronizer::Module::oam_dma,
+                sync.get_now() + (oam_dma_cycles >> sync.get_speed_shift())
+            );
+        }
+    }
+
+    /*
+     * Copies the next 16 bytes of an HDMA transfer into the current VRAM
+     * bank. The CPU is stalled meanwhile, which, as it can't observe the
+     * copy, amounts to ticking the clock past it.
+     */
+    void Bus::copy_hdma_block() {
+        auto bank = vram.data() + vram_bank * vram_bank_size;
+
+        for (size_t i = 0; i < 0x10; i++) {
+            uint16_t address = hdma_source + i;
+            auto page = read_pages[address >> 8];
+            auto offset = (hdma_dest + i) & 0x1fff;
+
+            bank[offset] = page ? page[address & 0xff] : read_slow(address);
+        }
+
+        auto offset = hdma_dest & 0x1fff;
+
+        vram_dirty[(vram_bank * vram_bank_size + offset) / page_size] = 1;
+
+        if (offset < 0x1800) {
+            tiles.invalidate(vram_bank * vram_bank_size + offset);
+        }
+
+        hdma_source += 0x10;
+        hdma_dest += 0x10;
+        sync.tick(hdma_block_cycles);
+
+        if (hdma_length-- == 0) {
+            hdma_active = false;
+        }
+    }
+
+    /*
+     * HDMA5: bit 7 clear starts a general purpose transfer, copied at once,
+     * or cancels an HBlank one still running; bit 7 set starts an HBlank
+     * transfer, which copies a block right away if already in HBlank.
+     */
+    void Bus::write_hdma(uint8_t value) {
+        if (hdma_active && !(value & 0x80)) {
+            hdma_active = false;
+            hdma_length = value & 0x7f;
+            return;
+        }
+
+        hdma_length = value & 0x7f;
+        hdma_active = true;
+
+        if (value & 0x80) {
+            if (io.in_hblank()) {
+                copy_hdma_block();
+            }
+
+            return;
+        }
+
+        while (hdma_active) {
+            copy_hdma_block();
+        }
+    }
+
+    /*
+     * Code cached from the old bank stays valid for it, but the watched
+     * pages no longer guard it, so it's reported as written.
+     */
+    void Bus::set_wram_bank(uint8_t value) {
+        auto bank = std::max(value & 0x07, 1);
+
+        if (bank == wram_bank) {
+            return;
+        }
+
+        wram_bank = bank;
+        written_code |= watched_code & 0xffff0000;
+        watched_code &= 0xffff;
+        map_memory();
+    }
+
+    // CGB only registers; on a DMG they read open bus and ignore writes
+    uint8_t Bus::read_cgb(uint16_t address) const {
+        if (!cgb) {
+            return 0xff;
+        }
+
+        switch (address) {
+            case 0xff4d:
+                return 0x7e | sync.get_speed_shift() << 7 | speed_switch_armed;
+            case 0xff4f:
+                return 0xfe | vram_bank;
+            case 0xff55:
+                return hdma_active ? hdma_length : hdma_length | 0x80;
+            case 0xff70:
+                return 0xf8 | wram_bank;
+            default:
+                return 0xff;
+        }
+    }
+
+    void Bus::write_cgb(uint16_t address, uint8_t value) {
+        if (!cgb) {
+            return;
+        }
+
+        switch (address) {
+            case 0xff4d:
+                speed_switch_armed = value & 0x01;
+                break;
+            case 0xff4f:
+                vram_bank = value & 0x01;
+                map_memory();
+                break;
+            case 0xff51:
+                hdma_source = (hdma_source & 0x00ff) | value << 8;
+                break;
+            case 0xff52:
+                hdma_source = (hdma_source & 0xff00) | (value & 0xf0);
+                break;
+            case 0xff53:
+                hdma_dest = (hdma_dest & 0x00ff) | (value & 0x1f) << 8;
+                break;
+            case 0xff54:
+                hdma_dest = (hdma_dest & 0xff00) | (value & 0xf0);
+                break;
+            case 0xff55:
+                write_hdma(value);
+                break;
+            case 0xff70:
+                set_wram_bank(value);
+                break;
+        }
+    }
+
+    bool Bus::switch_speed() {
+        if (!speed_switch_armed) {
+            return false;
+        }
+
+        speed_switch_armed = false;
+        sync.set_double_speed(!sync.get_speed_shift());
+        // Realigns the timer and the frame sequencer to the new speed
+        io.write(0x04, 0);
+
+        return true;
+    }
+
+    // Offset into wram of an address in 0xc000-0xfdff
+    size_t Bus::wram_offset(uint16_t address) const {
+        size_t offset = address & 0x1fff;
+
+        if (offset < wram_bank_size) {
+            return offset;
+        }
+
+        return wram_bank * wram_bank_size + offset - wram_bank_size;
+    }
+
+    void Bus::handle_events() {
+        using Module = Synchronizer::Module;
+
+        for (;;) {
+            switch (auto module = sync.pop_due_event()) {
+                case Module::cartridge:
+                    cartridge.flush();
+                    sync.set_next_event(
+                        module, sync.get_now() + cartridge.get_sync_interval()
+                    );
+                    break;
+                case Module::oam_dma:
+                    oam_dma_active = false;
+                    map_memory();
+                    break;
+                case Module::lcd:
+                    io.handle_event(module);
+
+                    if (hdma_active && io.in_hblank()) {
+                        copy_hdma_block();
+                    }
+                    break;
+                case Module::num_modules:
+                    return;
+                default:
+                    io.handle_event(module);
+                    break;
+            }
+        }
+    }
+
+    uint8_t Bus::read_slow(uint16_t address) {
+        if (oam_dma_active && address < 0xff00) [[unlikely]] {
+            return 0xff;
+        }
+
+        if (address < 0x8000) { // ROM not exposed by the MBC
             return cartridge.read_rom(address);
         } else if (address < 0xa000) { // vram
-            return vram[address - 0x8000];
+            return vram[vram_bank * vram_bank_size + address - 0x8000];
         } else if (address < 0xc000) { // eram
             return cartridge.read_ram(address - 0xa000);
-        } else if (address < 0xd000) { // wram bank 0
-            return wram[address - 0xc000];
-        } else if (address < 0xe000) { // wram bank 1-n
-            // CGB: implement bank switching
-            return wram[address - 0xd000];
-        } else if (address < 0xfe00) {
-            TODO("implement echo RAM");
+        } else if (address < 0xfe00) { // wram and its echo
+            return wram[wram_offset(address)];
         } else if (address < 0xfea0) {
             return oam[address - 0xfe00];
-        } else if (address < 0xff00) {
-            TODO("implement not usable range");
+        } else if (address < 0xff00) { // not usable
+            /*
+             * A DMG reads zeroes; later CGB revisions, the only ones
+             * modelled, repeat the high nibble of the address.
+             */
+            return cgb ? (address & 0xf0) | (address >> 4 & 0x0f) : 0x00;
         } else if (address < 0xff80) {
-            TODO("implement io");
+            if (is_cgb_register(address)) {
+                return read_cgb(address);
+            }
+
+            return io.read(address - 0xff00);
         } else if (address < 0xffff) {
             return hram[address - 0xff80];
         } else {
-            return ie;
+            return io.get_interrupts().read_enable();
+        }
+    }
+
+    void Bus::write_slow(uint16_t address, uint8_t value) {
+        if (oam_dma_active && address < 0xff00) [[unlikely]] {
+            return;
         }
-    } 
 
-    void Bus::write(uint16_t address, uint8_t value) {
-        if ( address >= 0x8000 && address < 0xa000) { // vram
-            vram[address - 0x8000] = value;
+        if (address < 0x8000) { // MBC registers
+            cartridge.write_rom(address, value);
+            remap_cartridge();
+        } else if (address < 0xa000) { // vram
+            auto offset = vram_bank * vram_bank_size + address - 0x8000;
+
+            vram[offset] = value;
+            vram_dirty[offset / page_size] = 1;
+
+            if (address < 0x9800) {
+                tiles.invalidate(offset);
+            }
         } else if (address < 0xc000) { // eram
             cartridge.write_ram(address - 0xa000, value);
-        } else if (address < 0xd000) { // wram bank 0
-            wram[address - 0xc000] = value;
-        } else if (address < 0xe000) { // wram bank 1-n
-            // TODO: CGB: implement bank switching
-            wram[address - 0xd000] = value;
-        } else if (address < 0xfe00) {
-            TODO("implement echo RAM");
+        } else if (address < 0xfe00) { // wram and its echo
+            auto page = (address & 0x1fff) / page_size;
+            auto offset = wram_offset(address);
+
+            wram[offset] = value;
+            wram_dirty[offset / page_size] = 1;
+
+            // Only watched pages get here; report them and stop watching
+            if (watched_code & (1u << page)) {
+                auto host = wram + offset - (offset & 0xff);
+
+                watched_code &= ~(1u << page);
+                written_code |= 1u << page;
+                write_pages[0xc0 + page] = host;
+
+                if (0xe0 + page < 0xfe) {
+                    write_pages[0xe0 + page] = host;
+                }
+            }
         } else if (address < 0xfea0) {
             oam[address - 0xfe00] = value;
-        } else if (address < 0xff00) {
-            TODO("implement not usable range");
+        } else if (address < 0xff00) { // not usable
+            // Writes are dropped
         } else if (address < 0xff80) {
-            TODO("implement io");
+            if (is_cgb_register(address)) {
+                write_cgb(address, value);
+                return;
+            }
+
+            io.write(address - 0xff00, value);
+
+            if (address == 0xff46) {
+                start_oam_dma(value);
+            }
         } else if (address < 0xffff) {
             hram[address - 0xff80] = value;
         } else {
-            ie = value;
+            io.get_interrupts().write_enable(value);
         }
     }
+
+    void Bus::watch_code(uint16_t address) {
+        auto page = (address - 0xc000) / page_size;
+
+        watched_code |= 1u << page;
+        unmap_wram_writes(page);
+    }
+
+    uint32_t Bus::take_code_writes() {
+        return std::exchange(written_code, 0);
+    }
+
+    /*
+     * A DMG instance only saves the memory it can reach, so its states
+     * stay as small as before.
+     */
+    void Bus::save_state(StateWriter &state) const {
+        state.put_pages(
+            vram.data(), cgb ? vram.size() : vram_bank_size, vram_dirty.data()
+        );
+        state.put_pages(
+            wram, cgb ? wram_size : 2 * wram_bank_size, wram_dirty.data()
+        );
+        state.put(oam, hram, oam_dma_active);
+        state.put(vram_bank, wram_bank, speed_switch_armed);
+        state.put(hdma_source, hdma_dest, hdma_length, hdma_active);
+        cartridge.save_state(state);
+        io.save_state(state);
+    }
+
+    void Bus::load_state(StateReader &state) {
+        state.get_pages(
+            vram.data(), cgb ? vram.size() : vram_bank_size, vram_dirty.data()
+        );
+        state.get_pages(
+            wram, cgb ? wram_size : 2 * wram_bank_size, wram_dirty.data()
+        );
+        state.get(oam, hram, oam_dma_active);
+        state.get(vram_bank, wram_bank, speed_switch_armed);
+        state.get(hdma_source, hdma_dest, hdma_length, hdma_active);
+        cartridge.load_state(state);
+        io.load_state(state);
+
+        tiles.invalidate_all();
+
+        // All of WRAM may have changed under the cached code
+        written_code |= std::exchange(watched_code, 0);
+        map_memory();
+    }
 }
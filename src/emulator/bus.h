@@ -1,23 +1,243 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
 #include "cartridge.hpp"
-#include "cartridge.hpp"
+#include "external_memory.h"
+#include "io_dispatcher.h"
+#include "profiler.h"
+#include "state.h"
+#include "sync.h"
+#include "tile_cache.h"
 
 namespace emulator {
     class Bus {
+        public:
+            // Eight 4 KiB banks; a DMG only ever uses the first two
+            static constexpr size_t wram_size = 1024 * 32;
+            static constexpr size_t wram_bank_size = 0x1000;
+
         private:
-            std::array<uint8_t, 1024 * 8> vram;
-            std::array<uint8_t, 1024 * 8> wram;
+            static constexpr size_t page_size = 0x100;
+            static constexpr size_t num_pages = 0x10000 / page_size;
+            // An OAM DMA transfer takes one M-cycle per byte
+            static constexpr uint64_t oam_dma_cycles = 160 * 4;
+            static constexpr size_t vram_bank_size = 0x2000;
+            // An HDMA block of 16 bytes takes 32 single speed cycles
+            static constexpr uint64_t hdma_block_cycles = 32;
+
+            // Whether the cartridge runs in CGB mode
+            bool cgb;
+
+            // Two banks of 8 KiB; a DMG only ever uses the first
+            std::array<uint8_t, 1024 * 16> vram;
+            // Points to owned_wram unless it was provided externally
+            std::unique_ptr<uint8_t[]> owned_wram;
+            uint8_t *wram;
             std::array<uint8_t, 160> oam;
             std::array<uint8_t, 127> hram;
-            uint8_t ie;
+
+            /*
+             * Pages written since the last incremental snapshot, which clears
+             * them from save_state.
+             */
+            mutable std::array<uint8_t, 1024 * 16 / page_size> vram_dirty;
+            mutable std::array<uint8_t, wram_size / page_size> wram_dirty;
+
+            // Decoded copy of the tile data in 0x8000-0x97ff of both banks
+            TileCache tiles;
 
             Cartridge &cartridge;
+            Synchronizer &sync;
+            IoDispatcher io;
+
+            /*
+             * One entry per 256-byte page of the address space. A non-null
+             * entry points straight at the host memory backing that page; a
+             * null entry sends the access through the slow path, which handles
+             * MMIO, the split pages at the top of the map, VRAM tile data
+             * (so the tile cache sees every write) and cartridge regions the
+             * MBC can't expose as plain memory.
+             */
+            std::array<const uint8_t *, num_pages> read_pages;
+            std::array<uint8_t *, num_pages> write_pages;
+            // Dirty flag of the memory behind each writable page
+            std::array<uint8_t *, num_pages> write_dirty;
+
+#ifdef GUB_PROFILE
+            // Sees every access; the CPU feeds it instructions
+            Profiler profiler;
+#endif
+
+            /*
+             * Accurate OAM DMA is a host setting; while a transfer runs in
+             * that mode, the CPU only reaches IO registers and HRAM.
+             */
+            bool accurate_oam_dma;
+            bool oam_dma_active;
+
+            // CGB banking: VBK and SVBK, the latter never 0
+            uint8_t vram_bank;
+            uint8_t wram_bank;
+            // KEY1 bit 0, the next STOP switches speed
+            bool speed_switch_armed;
+
+            /*
+             * VRAM DMA (HDMA1-HDMA5). length counts the 16-byte blocks left,
+             * minus one; an HBlank transfer copies one block per HBlank
+             * until it wraps.
+             */
+            uint16_t hdma_source;
+            uint16_t hdma_dest;
+            uint8_t hdma_length;
+            bool hdma_active;
+
+            /*
+             * WRAM pages (one bit each) of the CPU's view holding code it
+             * has cached. Bits 16-31 stand for 0xd000-0xdfff in every bank.
+             */
+            uint32_t watched_code;
+            // Watched pages written since the CPU last took them
+            uint32_t written_code;
+
+            void map(
+                uint16_t start, size_t size, const uint8_t *read, uint8_t *write,
+                uint8_t *dirty
+            );
+
+            void map_memory();
+            void unmap_wram_writes(size_t page);
+            size_t wram_offset(uint16_t address) const;
+            void start_oam_dma(uint8_t page);
+            void copy_hdma_block();
+            void write_hdma(uint8_t value);
+            void set_wram_bank(uint8_t value);
+
+            uint8_t read_cgb(uint16_t address) const;
+            void write_cgb(uint16_t address, uint8_t value);
+
+            uint8_t read_slow(uint16_t address);
+            void write_slow(uint16_t address, uint8_t value);
 
         public:
-            uint8_t read(uint16_t address);
-            void write(uint16_t address, uint8_t value);
+            Bus(
+                Cartridge &cartridge, Synchronizer &sync,
+                const ExternalMemory &memory
+            );
+
+            void remap_cartridge();
+
+            void handle_events();
+
+            // Covers the cartridge and every IO device behind the bus
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
+            const uint8_t *get_framebuffer() const;
+            uint64_t get_frame_count() const;
+            const std::string &get_serial_output() const;
+
+            void set_buttons(uint8_t pressed);
+
+            void set_sample_rate(uint32_t rate);
+            SampleRing &get_samples();
+
+            void set_video_enabled(bool enabled);
+            void set_audio_enabled(bool enabled);
+            void set_accurate_oam_dma(bool enabled);
+
+            inline bool is_cgb() const { return cgb; }
+            const uint8_t *get_palettes() const;
+
+            /*
+             * STOP: switches speed if KEY1 was armed, which also resets DIV.
+             * Returns whether it did.
+             */
+            bool switch_speed();
+
+            // IF and IE live in the interrupt controller
+            inline io::Interrupts &get_interrupts() {
+                return io.get_interrupts();
+            }
+
+            /*
+             * Code caching support. Only code in ROM and WRAM is cached: ROM
+             * never changes, and writes to watched WRAM pages take the slow
+             * path, which reports them until the CPU takes them.
+             */
+            inline const uint8_t *get_code_address(uint16_t address) const;
+            inline uint32_t get_code_page_mask(const uint8_t *key) const;
+            void watch_code(uint16_t address);
+            inline bool has_code_writes() const { return written_code; }
+            uint32_t take_code_writes();
+
+#ifdef GUB_PROFILE
+            inline Profiler &get_profiler() { return profiler; }
+            // Profiler location of the code at address
+            uint32_t get_location(uint16_t address) const;
+#endif
+
+            inline uint8_t read(uint16_t address);
+            inline void write(uint16_t address, uint8_t value);
     };
+
+    // Host address of the code at address, or nullptr if it can't be cached
+    inline const uint8_t *Bus::get_code_address(uint16_t address) const {
+        if (address >= 0x8000 && (address < 0xc000 || address >= 0xe000)) {
+            return nullptr;
+        }
+
+        auto page = read_pages[address >> 8];
+
+        return page ? page + (address & 0xff) : nullptr;
+    }
+
+    /*
+     * Watched page bit of the code at a host address returned by
+     * get_code_address, or 0 if it isn't in WRAM.
+     */
+    inline uint32_t Bus::get_code_page_mask(const uint8_t *key) const {
+        auto offset = uintptr_t(key) - uintptr_t(wram);
+
+        if (offset >= wram_size) {
+            return 0;
+        } else if (offset < wram_bank_size) {
+            return 1u << (offset / page_size);
+        }
+
+        return 1u << (16 + offset % wram_bank_size / page_size);
+    }
+
+    inline uint8_t Bus::read(uint16_t address) {
+#ifdef GUB_PROFILE
+        profiler.count_read(address);
+#endif
+
+        auto page = read_pages[address >> 8];
+
+        if (page) [[likely]] {
+            return page[address & 0xff];
+        }
+
+        return read_slow(address);
+    }
+
+    inline void Bus::write(uint16_t address, uint8_t value) {
+#ifdef GUB_PROFILE
+        profiler.count_write(address);
+#endif
+
+        auto page = write_pages[address >> 8];
+
+        if (page) [[likely]] {
+            page[address & 0xff] = value;
+            *write_dirty[address >> 8] = 1;
+            return;
+        }
+
+        write_slow(address, value);
+    }
 }
@@ -1,16 +1,523 @@
 #include "cartridge.hpp"
 #include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace emulator {
+    void Cartridge::Unmapper::operator()(const uint8_t *address) const {
+        munmap(const_cast<uint8_t *>(address), size);
+    }
+
+    std::expected<Cartridge, GameBoyError> Cartridge::open(
+        const char *path, const SaveOptions &options
+    ) {
+        int fd = ::open(path, O_RDONLY);
+
+        if (fd < 0) {
+            return std::unexpected(GameBoyError::io_error);
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return std::unexpected(GameBoyError::io_error);
+        }
+
+        size_t size = st.st_size;
+
+        if (size < 0x8000 || size % 0x4000 != 0) {
+            close(fd);
+            return std::unexpected(GameBoyError::invalid_cartridge);
+        }
+
+        void *address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (address == MAP_FAILED) {
+            return std::unexpected(GameBoyError::io_error);
+        }
+
+        std::unique_ptr<const uint8_t[], Unmapper> rom(
+            static_cast<const uint8_t *>(address), Unmapper{size}
+        );
+
+        auto type = rom[0x147];
+
+        switch (type) {
+            case 0x00: case 0x08: case 0x09:
+            case 0x01: case 0x02: case 0x03:
+            case 0x05: case 0x06:
+            case 0x0f: case 0x10: case 0x11: case 0x12: case 0x13:
+            case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x1e:
+                break;
+            default:
+                return std::unexpected(GameBoyError::invalid_cartridge);
+        }
+
+        auto ram_size = get_ram_size(type, rom[0x149]);
+        bool battery = has_battery(type) && ram_size > 0;
+        std::string save_path;
+
+        if (battery) {
+            save_path = options.path;
+
+            if (save_path.empty()) {
+                save_path = path;
+                auto dot = save_path.find_last_of('.');
+                auto slash = save_path.find_last_of('/');
+
+                if (dot != std::string::npos &&
+                    (slash == std::string::npos || dot > slash)) {
+                    save_path.erase(dot);
+                }
+
+                save_path += ".sav";
+            }
+        }
+
+        auto ram = map_ram(ram_size, save_path, options.mode);
+
+        if (!ram) {
+            return std::unexpected(ram.error());
+        }
+
+        return Cartridge(
+            std::move(rom), size, std::move(*ram), ram_size,
+            battery && options.mode == SaveOptions::Mode::shared,
+            battery ? options.sync_interval : 0
+        );
+    }
+
+    size_t Cartridge::get_ram_size(uint8_t type, uint8_t ram_code) {
+        static constexpr std::array<size_t, 6> ram_sizes = {
+            0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
+        };
+
+        if (type == 0x05 || type == 0x06) {
+            // 512 half-bytes built into the MBC2
+            return 0x200;
+        }
+
+        return ram_code < ram_sizes.size() ? ram_sizes[ram_code] : 0;
+    }
+
+    bool Cartridge::has_battery(uint8_t type) {
+        switch (type) {
+            case 0x03: case 0x06: case 0x09: case 0x0f: case 0x10: case 0x13:
+            case 0x1b: case 0x1e:
+                return true;
+        }
+
+        return false;
+    }
+
+    /*
+     * Volatile RAM (or any RAM when there is no save path) is an anonymous
+     * mapping. Battery RAM maps the save file itself, growing it to the RAM
+     * size first in shared mode. A copy-on-write run never touches the file,
+     * so a missing or short save is copied into anonymous memory instead.
+     */
+    std::expected<std::unique_ptr<uint8_t[], Cartridge::Unmapper>, GameBoyError>
+    Cartridge::map_ram(
+        size_t size, const std::string &path, SaveOptions::Mode mode
+    ) {
+        if (size == 0) {
+            return std::unique_ptr<uint8_t[], Unmapper>(nullptr, Unmapper{0});
+        }
+
+        bool shared = mode == SaveOptions::Mode::shared;
+        int fd = -1;
+
+        if (!path.empty()) {
+            fd = ::open(path.c_str(), shared ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+            if (fd < 0 && shared) {
+                return std::unexpected(GameBoyError::io_error);
+            }
+        }
+
+        struct stat st{};
+
+        if (fd >= 0 && fstat(fd, &st) < 0) {
+            close(fd);
+            return std::unexpected(GameBoyError::io_error);
+        }
+
+        size_t file_size = fd >= 0 ? st.st_size : 0;
+
+        if (shared && fd >= 0 && file_size < size) {
+            if (ftruncate(fd, size) < 0) {
+                close(fd);
+                return std::unexpected(GameBoyError::io_error);
+            }
+
+            file_size = size;
+        }
+
+        void *address;
+
+        if (fd >= 0 && file_size >= size) {
+            address = mmap(
+                nullptr, size, PROT_READ | PROT_WRITE,
+                shared ? MAP_SHARED : MAP_PRIVATE, fd, 0
+            );
+        } else {
+            address = mmap(
+                nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+            );
+
+            if (address != MAP_FAILED && fd >= 0 && file_size > 0) {
+                if (pread(fd, address, file_size, 0) < 0) {
+                    munmap(address, size);
+                    address = MAP_FAILED;
+                }
+            }
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (address == MAP_FAILED) {
+            return std::unexpected(GameBoyError::io_error);
+        }
+
+        return std::unique_ptr<uint8_t[], Unmapper>(
+            static_cast<uint8_t *>(address), Unmapper{size}
+        );
+    }
+
+    Cartridge::Cartridge(
+        std::unique_ptr<const uint8_t[], Unmapper> rom, size_t rom_size,
+        std::unique_ptr<uint8_t[], Unmapper> ram, size_t ram_size,
+        bool shared_save, uint64_t sync_interval
+    ) : rom(std::move(rom)), rom_size(rom_size), ram(std::move(ram)),
+        ram_size(ram_size),
+        ram_dirty(std::make_unique<uint8_t[]>(ram_size / state_page_size)),
+        mbc(Mbc::none), has_rtc(false),
+        shared_save(shared_save), sync_interval(sync_interval),
+        ram_enabled(false), rom_bank(1), ram_bank(0), banking_mode(false),
+        rtc_seconds(0), rtc_timestamp(std::time(nullptr)), rtc_halted(false),
+        rtc_day_carry(false), rtc_latch_armed(false), rtc_latched{} {
+        auto type = this->rom[0x147];
+
+        switch (type) {
+            case 0x01: case 0x02: case 0x03:
+                mbc = Mbc::mbc1;
+                break;
+            case 0x05: case 0x06:
+                mbc = Mbc::mbc2;
+                break;
+            case 0x0f: case 0x10: case 0x11: case 0x12: case 0x13:
+                mbc = Mbc::mbc3;
+                has_rtc = type == 0x0f || type == 0x10;
+                break;
+            case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x1e:
+                mbc = Mbc::mbc5;
+                break;
+        }
+
+        // Without an MBC there is nothing to gate the RAM
+        ram_enabled = mbc == Mbc::none;
+
+        update_banks();
+    }
+
+    size_t Cartridge::get_rom_banks() const {
+        return rom_size / 0x4000;
+    }
+
+    size_t Cartridge::get_ram_banks() const {
+        return ram_size <= 0x2000 ? 1 : ram_size / 0x2000;
+    }
+
+    /*
+     * Recomputes the host address behind every window. Reads never compute a
+     * bank offset; the bus maps these pointers directly.
+     */
+    void Cartridge::update_banks() {
+        size_t bank0 = 0;
+        size_t bankn = rom_bank;
+        size_t ram_index = 0;
+
+        switch (mbc) {
+            case Mbc::none:
+                bankn = 1;
+                break;
+            case Mbc::mbc1:
+                bankn = (ram_bank << 5) | (rom_bank & 0x1f);
+                if (banking_mode) {
+                    bank0 = ram_bank << 5;
+                    ram_index = ram_bank;
+                }
+                break;
+            case Mbc::mbc2:
+            case Mbc::mbc3:
+            case Mbc::mbc5:
+                ram_index = ram_bank;
+                break;
+        }
+
+        rom_bank0_base = rom.get() + (bank0 % get_rom_banks()) * 0x4000;
+        rom_bankn_base = rom.get() + (bankn % get_rom_banks()) * 0x4000;
+
+        if (!ram_enabled || ram_size < 0x2000 || mbc == Mbc::mbc2 ||
+            rtc_selected()) {
+            ram_bank_base = nullptr;
+        } else {
+            ram_bank_base = ram.get() + (ram_index % get_ram_banks()) * 0x2000;
+        }
+    }
+
+    bool Cartridge::rtc_selected() const {
+        return has_rtc && ram_bank >= 0x08;
+    }
+
+    void Cartridge::update_rtc() {
+        auto now = std::time(nullptr);
+
+        if (!rtc_halted) {
+            rtc_seconds += now - rtc_timestamp;
+        }
+
+        rtc_timestamp = now;
+
+        // The day counter is 9 bits wide; overflowing it sets the carry
+        constexpr int64_t max_seconds = 512 * 86400;
+
+        if (rtc_seconds >= max_seconds) {
+            rtc_seconds %= max_seconds;
+            rtc_day_carry = true;
+        }
+    }
+
+    Cartridge::Rtc Cartridge::get_rtc() {
+        update_rtc();
+
+        auto days = rtc_seconds / 86400;
+
+        return {
+            static_cast<uint8_t>(rtc_seconds % 60),
+            static_cast<uint8_t>(rtc_seconds / 60 % 60),
+            static_cast<uint8_t>(rtc_seconds / 3600 % 24),
+            static_cast<uint8_t>(days & 0xff),
+            static_cast<uint8_t>(
+                ((days >> 8) & 1) | (rtc_halted << 6) | (rtc_day_carry << 7)
+            )
+        };
+    }
+
+    void Cartridge::set_rtc(const Rtc &value) {
+        int64_t days = value.dl | ((value.dh & 1) << 8);
+
+        rtc_seconds = (value.s % 60) + (value.m % 60) * 60 +
+            (value.h % 24) * 3600 + days * 86400;
+        rtc_timestamp = std::time(nullptr);
+        rtc_halted = value.dh & 0x40;
+        rtc_day_carry = value.dh & 0x80;
+    }
+
+    Cartridge::Mbc Cartridge::get_mbc() const {
+        return mbc;
+    }
+
+    bool Cartridge::supports_cgb() const {
+        return rom[0x143] & 0x80;
+    }
+
+    uint64_t Cartridge::get_sync_interval() const {
+        return sync_interval;
+    }
+
+    /*
+     * Schedules write-back of the dirty save pages without waiting for it;
+     * the kernel would write them back eventually anyway.
+     */
+    void Cartridge::flush() {
+        if (shared_save) {
+            msync(ram.get(), ram_size, MS_ASYNC);
+        }
+    }
+
+    const uint8_t *Cartridge::get_rom_bank0() const {
+        return rom_bank0_base;
+    }
+
+    const uint8_t *Cartridge::get_rom_bankn() const {
+        return rom_bankn_base;
+    }
+
+    size_t Cartridge::get_rom_bank(uint16_t address) const {
+        auto base = address < 0x4000 ? rom_bank0_base : rom_bankn_base;
+
+        return (base - rom.get()) / 0x4000;
+    }
+
+    uint8_t *Cartridge::get_ram_bank() {
+        return ram_bank_base;
+    }
+
+    uint8_t *Cartridge::get_ram_bank_dirty() {
+        if (!ram_bank_base) {
+            return nullptr;
+        }
+
+        return ram_dirty.get() + (ram_bank_base - ram.get()) / state_page_size;
+    }
+
     uint8_t Cartridge::read_rom(uint16_t address) const {
-        TODO();
+        if (address < 0x4000) {
+            return rom_bank0_base[address];
+        }
+
+        return rom_bankn_base[address - 0x4000];
+    }
+
+    void Cartridge::write_rom(uint16_t address, uint8_t value) {
+        switch (mbc) {
+            case Mbc::none:
+                return;
+            case Mbc::mbc1:
+                if (address < 0x2000) {
+                    ram_enabled = (value & 0xf) == 0xa;
+                } else if (address < 0x4000) {
+                    rom_bank = (value & 0x1f) ? value & 0x1f : 1;
+                } else if (address < 0x6000) {
+                    ram_bank = value & 0b11;
+                } else {
+                    banking_mode = value & 1;
+                }
+                break;
+            case Mbc::mbc2:
+                if (address >= 0x4000) {
+                    return;
+                }
+
+                // Address bit 8 selects between the two registers
+                if (address & 0x100) {
+                    rom_bank = (value & 0xf) ? value & 0xf : 1;
+                } else {
+                    ram_enabled = (value & 0xf) == 0xa;
+                }
+                break;
+            case Mbc::mbc3:
+                if (address < 0x2000) {
+                    ram_enabled = (value & 0xf) == 0xa;
+                } else if (address < 0x4000) {
+                    rom_bank = (value & 0x7f) ? value & 0x7f : 1;
+                } else if (address < 0x6000) {
+                    ram_bank = value & 0xf;
+                } else if (has_rtc) {
+                    // Writing 0 then 1 latches the clock
+                    if (rtc_latch_armed && value == 1) {
+                        rtc_latched = get_rtc();
+                    }
+
+                    rtc_latch_armed = value == 0;
+                }
+                break;
+            case Mbc::mbc5:
+                if (address < 0x2000) {
+                    ram_enabled = (value & 0xf) == 0xa;
+                } else if (address < 0x3000) {
+                    rom_bank = (rom_bank & 0x100) | value;
+                } else if (address < 0x4000) {
+                    rom_bank = (rom_bank & 0xff) | ((value & 1) << 8);
+                } else if (address < 0x6000) {
+                    ram_bank = value & 0xf;
+                }
+                break;
+        }
+
+        update_banks();
     }
 
+    /*
+     * Only reached for windows update_banks couldn't expose as plain memory:
+     * disabled RAM, the MBC2 nibble RAM and the MBC3 clock registers.
+     */
     uint8_t Cartridge::read_ram(uint16_t address) const {
-        TODO();
+        if (!ram_enabled) {
+            return 0xff;
+        }
+
+        if (mbc == Mbc::mbc2) {
+            return 0xf0 | ram[address & 0x1ff];
+        }
+
+        if (rtc_selected()) {
+            switch (ram_bank) {
+                case 0x08: return rtc_latched.s;
+                case 0x09: return rtc_latched.m;
+                case 0x0a: return rtc_latched.h;
+                case 0x0b: return rtc_latched.dl;
+                case 0x0c: return rtc_latched.dh;
+            }
+
+            return 0xff;
+        }
+
+        if (ram_size == 0) {
+            return 0xff;
+        }
+
+        return ram[address % ram_size];
     }
 
     void Cartridge::write_ram(uint16_t address, uint8_t value) {
-        TODO();
+        if (!ram_enabled) {
+            return;
+        }
+
+        if (mbc == Mbc::mbc2) {
+            ram[address & 0x1ff] = value & 0xf;
+            ram_dirty[(address & 0x1ff) / state_page_size] = 1;
+            return;
+        }
+
+        if (rtc_selected()) {
+            auto rtc = get_rtc();
+
+            switch (ram_bank) {
+                case 0x08: rtc.s = value; break;
+                case 0x09: rtc.m = value; break;
+                case 0x0a: rtc.h = value; break;
+                case 0x0b: rtc.dl = value; break;
+                case 0x0c: rtc.dh = value; break;
+                default: return;
+            }
+
+            set_rtc(rtc);
+            return;
+        }
+
+        if (ram_size != 0) {
+            ram[address % ram_size] = value;
+            ram_dirty[(address % ram_size) / state_page_size] = 1;
+        }
+    }
+
+    void Cartridge::save_state(StateWriter &state) const {
+        state.put(
+            ram_enabled, rom_bank, ram_bank, banking_mode, rtc_seconds,
+            rtc_timestamp, rtc_halted, rtc_day_carry, rtc_latch_armed,
+            rtc_latched
+        );
+        state.put_pages(ram.get(), ram_size, ram_dirty.get());
+    }
+
+    void Cartridge::load_state(StateReader &state) {
+        state.get(
+            ram_enabled, rom_bank, ram_bank, banking_mode, rtc_seconds,
+            rtc_timestamp, rtc_halted, rtc_day_carry, rtc_latch_armed,
+            rtc_latched
+        );
+        state.get_pages(ram.get(), ram_size, ram_dirty.get());
+        update_banks();
     }
 }
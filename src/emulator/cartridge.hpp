@@ -1,16 +1,151 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <vector>
+#include <ctime>
+#include <expected>
+#include <memory>
+#include <string>
+#include "defs.h"
+#include "state.h"
 
 namespace emulator {
+    /*
+     * How battery-backed cartridge RAM is persisted. The save file is mapped
+     * straight into the RAM window, so writes reach the page cache with no
+     * explicit save step:
+     *  - shared: MAP_SHARED, writes end up in the save file;
+     *  - copy_on_write: MAP_PRIVATE, the save is loaded but never modified,
+     *    for throwaway runs.
+     * With a non-zero sync_interval, dirty pages are also flushed with msync
+     * every sync_interval T-cycles of emulated time.
+     */
+    struct SaveOptions {
+        enum class Mode: uint8_t {
+            shared,
+            copy_on_write
+        };
+
+        Mode mode = Mode::shared;
+        // Defaults to the ROM path with a .sav extension
+        std::string path;
+        uint64_t sync_interval = 0;
+    };
+
     class Cartridge {
+        public:
+            enum class Mbc: uint8_t {
+                none,
+                mbc1,
+                mbc2,
+                mbc3,
+                mbc5
+            };
+
         private:
-            std::vector<uint8_t> rom;
-            std::vector<uint8_t> ram;
+            struct Unmapper {
+                size_t size;
+
+                void operator()(const uint8_t *address) const;
+            };
+
+            struct Rtc {
+                uint8_t s;
+                uint8_t m;
+                uint8_t h;
+                uint8_t dl;
+                uint8_t dh;
+            };
+
+            /*
+             * The ROM image is mapped read-only and shared, so every instance
+             * running the same file is backed by the same page cache pages.
+             */
+            std::unique_ptr<const uint8_t[], Unmapper> rom;
+            size_t rom_size;
+            std::unique_ptr<uint8_t[], Unmapper> ram;
+            size_t ram_size;
+            // One flag per page of RAM written since the last checkpoint
+            std::unique_ptr<uint8_t[]> ram_dirty;
+
+            Mbc mbc;
+            bool has_rtc;
+            bool shared_save;
+            uint64_t sync_interval;
+
+            bool ram_enabled;
+            uint16_t rom_bank;
+            uint8_t ram_bank;
+            bool banking_mode;
+
+            const uint8_t *rom_bank0_base;
+            const uint8_t *rom_bankn_base;
+            uint8_t *ram_bank_base;
+
+            int64_t rtc_seconds;
+            std::time_t rtc_timestamp;
+            bool rtc_halted;
+            bool rtc_day_carry;
+            bool rtc_latch_armed;
+            Rtc rtc_latched;
+
+            Cartridge(
+                std::unique_ptr<const uint8_t[], Unmapper> rom, size_t rom_size,
+                std::unique_ptr<uint8_t[], Unmapper> ram, size_t ram_size,
+                bool shared_save, uint64_t sync_interval
+            );
+
+            static size_t get_ram_size(uint8_t type, uint8_t ram_code);
+            static bool has_battery(uint8_t type);
+            static std::expected<std::unique_ptr<uint8_t[], Unmapper>, GameBoyError>
+                map_ram(size_t size, const std::string &path, SaveOptions::Mode mode);
+
+            size_t get_rom_banks() const;
+            size_t get_ram_banks() const;
+
+            void update_banks();
+
+            void update_rtc();
+            Rtc get_rtc();
+            void set_rtc(const Rtc &value);
+            bool rtc_selected() const;
 
         public:
-            uint8_t read_rom(uint16_t address) const; 
+            static std::expected<Cartridge, GameBoyError> open(
+                const char *path, const SaveOptions &options = {}
+            );
+
+            Cartridge(Cartridge &&) = default;
+            Cartridge(const Cartridge &) = delete;
+            Cartridge &operator=(const Cartridge &) = delete;
+
+            Mbc get_mbc() const;
+            // Header flag of games made for, or enhanced for, the CGB
+            bool supports_cgb() const;
+
+            uint64_t get_sync_interval() const;
+
+            // Banking, RTC and the whole RAM; the ROM never changes
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+            void flush();
+
+            /*
+             * Host memory currently visible through each cartridge window, or
+             * nullptr when the window can't be accessed as plain memory and
+             * must go through read_rom/read_ram/write_ram instead.
+             */
+            const uint8_t *get_rom_bank0() const;
+            const uint8_t *get_rom_bankn() const;
+            // ROM bank mapped at a 0x0000-0x7fff address
+            size_t get_rom_bank(uint16_t address) const;
+            uint8_t *get_ram_bank();
+            // Dirty flag of the first page get_ram_bank() points to
+            uint8_t *get_ram_bank_dirty();
+
+            uint8_t read_rom(uint16_t address) const;
+            void write_rom(uint16_t address, uint8_t value);
 
             uint8_t read_ram(uint16_t address) const;
             void write_ram(uint16_t address, uint8_t value);
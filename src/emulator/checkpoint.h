@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "state.h"
+
+namespace emulator {
+    /*
+     * Incremental save state. Holds the small unpaged part of the state in
+     * full, plus only the memory pages written since its parent was taken;
+     * restoring walks up the parent chain for the remaining pages. The first
+     * checkpoint of a chain holds every page.
+     *
+     * Checkpoints are immutable once taken, so any number of children can
+     * branch off the same parent.
+     */
+    class Checkpoint {
+        private:
+            friend class CPU;
+
+            std::shared_ptr<const Checkpoint> parent;
+            std::vector<uint8_t> core;
+            PageSet pages;
+
+        public:
+            inline const Checkpoint *get_parent() const {
+                return parent.get();
+            }
+
+            // Bytes held by this checkpoint alone, not counting its parents
+            inline size_t get_memory_usage() const {
+                return sizeof(*this) + core.size() + pages.data.size() +
+                    pages.indexes.size() * sizeof(uint32_t);
+            }
+    };
+}
@@ -1,11 +1,246 @@
+#include <bit>
 #include <cstdint>
+#include <cstring>
 #include <expected>
 #include <utility>
+#include <vector>
 #include "bus.h"
 #include "cpu.h"
 #include "defs.h"
 
 namespace emulator {
+    namespace {
+        constexpr uint8_t instruction_length(uint8_t opcode) {
+            if ((opcode & 0xcf) == 0x01) return 3; // ld r16, imm16
+            if ((opcode & 0xc7) == 0x06) return 2; // ld r8, imm8
+            if ((opcode & 0xc7) == 0xc6) return 2; // alu a, imm8
+            if ((opcode & 0xe7) == 0xc2) return 3; // jp cond, imm16
+            if ((opcode & 0xe7) == 0xc4) return 3; // call cond, imm16
+
+            switch (opcode) {
+                case 0x08: case 0xc3: case 0xcd: case 0xea: case 0xfa:
+                    return 3;
+                case 0x10: case 0x18: case 0x20: case 0x28: case 0x30:
+                case 0x38: case 0xcb: case 0xe0: case 0xe8: case 0xf0:
+                case 0xf8:
+                    return 2;
+            }
+
+            return 1;
+        }
+
+        /*
+         * Cost in T-cycles, with conditional branches not taken. 0xcb only
+         * counts the prefix fetch; cb_instruction_cycles has the rest.
+         */
+        constexpr uint8_t instruction_cycles(uint8_t opcode) {
+            if ((opcode & 0xc0) == 0x40) { // ld r8, r8; halt
+                bool hl_operand =
+                    (opcode & 0x07) == 6 || (opcode & 0x38) == 0x30;
+
+                return hl_operand && opcode != 0x76 ? 8 : 4;
+            }
+
+            if ((opcode & 0xc0) == 0x80) { // alu a, r8
+                return (opcode & 0x07) == 6 ? 8 : 4;
+            }
+
+            if ((opcode & 0xcf) == 0x01) return 12; // ld r16, imm16
+            if ((opcode & 0xc7) == 0x02) return 8; // ld (r16mem), a and back
+            if ((opcode & 0xc7) == 0x03) return 8; // inc r16, dec r16
+            if ((opcode & 0xcf) == 0x09) return 8; // add hl, r16
+            if ((opcode & 0xc6) == 0x04) { // inc r8, dec r8
+                return opcode == 0x34 || opcode == 0x35 ? 12 : 4;
+            }
+            if ((opcode & 0xc7) == 0x06) { // ld r8, imm8
+                return opcode == 0x36 ? 12 : 8;
+            }
+            if ((opcode & 0xe7) == 0x20) return 8; // jr cond, imm8
+            if ((opcode & 0xe7) == 0xc0) return 8; // ret cond
+            if ((opcode & 0xe7) == 0xc2) return 12; // jp cond, imm16
+            if ((opcode & 0xe7) == 0xc4) return 12; // call cond, imm16
+            if ((opcode & 0xcf) == 0xc1) return 12; // pop r16stk
+            if ((opcode & 0xcf) == 0xc5) return 16; // push r16stk
+            if ((opcode & 0xc7) == 0xc6) return 8; // alu a, imm8
+            if ((opcode & 0xc7) == 0xc7) return 16; // rst
+
+            switch (opcode) {
+                case 0x08: // ld (imm16), sp
+                    return 20;
+                case 0xcd: // call imm16
+                    return 24;
+                case 0xc3: case 0xc9: case 0xd9: case 0xe8: case 0xea:
+                case 0xfa:
+                    return 16;
+                case 0x18: case 0xe0: case 0xf0: case 0xf8:
+                    return 12;
+                case 0xe2: case 0xf2: case 0xf9:
+                    return 8;
+            }
+
+            return 4;
+        }
+
+        // Cost of the instruction after a 0xcb prefix, the prefix excluded
+        constexpr uint8_t cb_instruction_cycles(uint8_t opcode) {
+            if ((opcode & 0x07) != 6) {
+                return 4;
+            }
+
+            return (opcode & 0xc0) == 0x40 ? 8 : 12; // bit b3, (hl)
+        }
+
+        // What a conditional branch costs on top when it's taken
+        constexpr uint8_t taken_cycles(uint8_t opcode) {
+            if ((opcode & 0xe7) == 0x20 || (opcode & 0xe7) == 0xc2) {
+                return 4; // jr, jp
+            }
+
+            if ((opcode & 0xe7) == 0xc0 || (opcode & 0xe7) == 0xc4) {
+                return 12; // ret, call
+            }
+
+            return 0;
+        }
+
+        constexpr std::array<uint8_t, 256> make_cycle_table(
+            uint8_t (*cost)(uint8_t)
+        ) {
+            std::array<uint8_t, 256> table{};
+
+            for (size_t opcode = 0; opcode < table.size(); opcode++) {
+                table[opcode] = cost(opcode);
+            }
+
+            return table;
+        }
+
+        constexpr auto op_cycles = make_cycle_table(instruction_cycles);
+        constexpr auto cb_cycles = make_cycle_table(cb_instruction_cycles);
+
+        // Instructions after which execution may not fall through
+        constexpr bool ends_block(uint8_t opcode) {
+            switch (opcode) {
+                case 0x10: case 0x76: // stop, halt
+                case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+                case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda:
+                case 0xe9: // jp
+                case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc: // call
+                case 0xc0: case 0xc8: case 0xc9: case 0xd0: case 0xd8:
+                case 0xd9: // ret, reti
+                case 0xf3: case 0xfb: // di, ei
+                case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4:
+                case 0xeb: case 0xec: case 0xed: case 0xf4: case 0xfc:
+                case 0xfd: // illegal
+                    return true;
+            }
+
+            return (opcode & 0xc7) == 0xc7; // rst
+        }
+
+        /*
+         * Memory whose value can only change when an event fires: IF, STAT
+         * and LY, plus RAM, which only interrupt handlers could modify.
+         */
+        constexpr bool polled_address(uint16_t address) {
+            return (address >= 0xc000 && address < 0xe000) ||
+                (address >= 0xff80 && address < 0xffff) ||
+                address == 0xff0f || address == 0xff41 || address == 0xff44;
+        }
+
+        /*
+         * Recognizes polling loops, such as waiting on LY or on a flag an
+         * interrupt handler sets: code that only loads A from polled memory,
+         * tests it and branches back to its own start. A is always loaded
+         * before it's read and nothing else is written, so every iteration
+         * ends in the same state until an event changes what it reads.
+         */
+        constexpr bool is_idle_loop(
+            const uint8_t *code, size_t size, uint16_t start
+        ) {
+            bool a_loaded = false;
+
+            for (size_t offset = 0; offset < size;) {
+                auto opcode = code[offset];
+                auto length = instruction_length(opcode);
+                bool last = offset + length == size;
+                uint16_t next = start + offset + length;
+
+                switch (opcode) {
+                    case 0x00: // nop
+                        break;
+                    case 0xf0: // ldh a, (imm8)
+                        if (!polled_address(0xff00 | code[offset + 1])) {
+                            return false;
+                        }
+
+                        a_loaded = true;
+                        break;
+                    case 0xfa: // ld a, (imm16)
+                        if (!polled_address(
+                            code[offset + 1] | code[offset + 2] << 8
+                        )) {
+                            return false;
+                        }
+
+                        a_loaded = true;
+                        break;
+                    case 0xa7: case 0xb7: // and a, or a
+                    case 0xe6: case 0xee: case 0xf6: case 0xfe: // alu imm8
+                        if (!a_loaded) {
+                            return false;
+                        }
+
+                        break;
+                    case 0xcb: // bit b3, a
+                        if ((code[offset + 1] & 0xc7) != 0x47 || !a_loaded) {
+                            return false;
+                        }
+
+                        break;
+                    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+                        return last && static_cast<uint16_t>(
+                            next + static_cast<int8_t>(code[offset + 1])
+                        ) == start;
+                    case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda: // jp
+                        return last &&
+                            (code[offset + 1] | code[offset + 2] << 8) == start;
+                    default:
+                        return false;
+                }
+
+                offset += length;
+            }
+
+            return false;
+        }
+    }
+
+    // Register state left behind by the DMG or CGB boot ROM
+    CPU::CPU(Cartridge &cartridge, const ExternalMemory &memory)
+        : sp(0xfffe), pc(0x0100), halted(false),
+          bus(cartridge, sync, memory), interrupts(bus.get_interrupts()),
+          blocks(std::make_unique<std::array<Block, block_cache_size>>()),
+          code_rewrites{}, uncached_code(0) {
+        if (bus.is_cgb()) {
+            af.pair = 0x1180;
+            bc.pair = 0x0000;
+            de.pair = 0xff56;
+            hl.pair = 0x000d;
+        } else {
+            af.pair = 0x01b0;
+            bc.pair = 0x0013;
+            de.pair = 0x00d8;
+            hl.pair = 0x014d;
+        }
+
+        StateWriter counter;
+        save_body(counter);
+
+        core_size = counter.get_size() - counter.get_paged_size();
+        page_count = counter.get_paged_size() / state_page_size;
+    }
+
     inline uint8_t CPU::get_a() { return af.regs.high; }
     inline uint8_t CPU::get_f() { return af.regs.low; }
     inline uint8_t CPU::get_b() { return bc.regs.high; }
@@ -24,356 +259,290 @@ namespace emulator {
     inline void CPU::set_h(uint8_t value) { hl.regs.high = value; }
     inline void CPU::set_l(uint8_t value) { hl.regs.low = value;  }
 
-    inline bool CPU::get_flag_z(void) { return get_f() & 8; }
-    inline bool CPU::get_flag_n(void) { return get_f() & 4; }
-    inline bool CPU::get_flag_h(void) { return get_f() & 2; }
-    inline bool CPU::get_flag_c(void) { return get_f() & 1; }
+    inline bool CPU::get_flag_z(void) {
+        return (get_f() >> std::to_underlying(Flags::z)) & 1;
+    }
+
+    inline bool CPU::get_flag_n(void) {
+        return (get_f() >> std::to_underlying(Flags::n)) & 1;
+    }
 
-    void CPU::set_flag_z(bool value) {
-        uint8_t mask = 8;
+    inline bool CPU::get_flag_h(void) {
+        return (get_f() >> std::to_underlying(Flags::h)) & 1;
+    }
 
-        set_f((get_f() & ~mask) | (value << 3));
+    inline bool CPU::get_flag_c(void) {
+        return (get_f() >> std::to_underlying(Flags::c)) & 1;
     }
 
-    void CPU::set_flag_n(bool value) {
-        uint8_t mask = 4;
+    inline void CPU::set_flag_z(bool value) {
+        constexpr auto shift = std::to_underlying(Flags::z);
 
-        set_f((get_f() & ~mask) | (value << 2));
+        set_f((get_f() & ~(1 << shift)) | (value << shift));
     }
 
-    void CPU::set_flag_h(bool value) {
-        uint8_t mask = 2;
+    inline void CPU::set_flag_n(bool value) {
+        constexpr auto shift = std::to_underlying(Flags::n);
 
-        set_f((get_f() & ~mask) | (value << 1));
+        set_f((get_f() & ~(1 << shift)) | (value << shift));
     }
 
-    void CPU::set_flag_c(bool value) {
-        uint8_t mask = 1;
+    inline void CPU::set_flag_h(bool value) {
+        constexpr auto shift = std::to_underlying(Flags::h);
 
-        set_f((get_f() & ~mask) | value);
+        set_f((get_f() & ~(1 << shift)) | (value << shift));
     }
 
-    std::expected<uint8_t, GameBoyError> CPU::get_r8(uint8_t r8) 
-    {
-        switch (r8) {
-            case 0:
-                return get_b();
-            case 1:
-                return get_c();
-            case 2:
-                return get_d();
-            case 3:
-                return get_e();
-            case 4:
-                return get_h();
-            case 5:
-                return get_l();
-            case 6:
-                return bus.read(hl.pair);
-            case 7:
-                return get_a();
-        }
+    inline void CPU::set_flag_c(bool value) {
+        constexpr auto shift = std::to_underlying(Flags::c);
 
-        return std::unexpected(GameBoyError::invalid_register);
+        set_f((get_f() & ~(1 << shift)) | (value << shift));
     }
 
-    std::expected<void, GameBoyError> CPU::set_r8(
-        uint8_t r8, uint8_t value
-    ) {
-        switch (r8) {
-            case 0:
-                set_b(value);
-                return {};
-            case 1:
-                set_c(value);
-                return {};
-            case 2:
-                set_d(value);
-                return {};
-            case 3:
-                set_e(value);
-                return {};
-            case 4:
-                set_h(value);
-                return {};
-            case 5:
-                set_l(value);
-                return {};
-            case 6:
-                bus.write(hl.pair, value);
-                return {};
-            case 7:
-                set_a(value);
-                return {};
-        }
+    template <R8 r8>
+    inline uint8_t CPU::get_r8(void) {
+        if constexpr (r8 == R8::b) return get_b();
+        else if constexpr (r8 == R8::c) return get_c();
+        else if constexpr (r8 == R8::d) return get_d();
+        else if constexpr (r8 == R8::e) return get_e();
+        else if constexpr (r8 == R8::h) return get_h();
+        else if constexpr (r8 == R8::l) return get_l();
+        else if constexpr (r8 == R8::hl) return bus.read(hl.pair);
+        else return get_a();
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    template <R8 r8>
+    inline void CPU::set_r8(uint8_t value) {
+        if constexpr (r8 == R8::b) set_b(value);
+        else if constexpr (r8 == R8::c) set_c(value);
+        else if constexpr (r8 == R8::d) set_d(value);
+        else if constexpr (r8 == R8::e) set_e(value);
+        else if constexpr (r8 == R8::h) set_h(value);
+        else if constexpr (r8 == R8::l) set_l(value);
+        else if constexpr (r8 == R8::hl) bus.write(hl.pair, value);
+        else set_a(value);
     }
 
-    std::expected<uint16_t, GameBoyError> CPU::get_r16(uint8_t r16) {
-        switch (r16) {
-            case 0:
-                return bc.pair;
-            case 1:
-                return de.pair;
-            case 2:
-                return hl.pair;
-            case 3:
-                return sp;
-        }
+    template <R16 r16>
+    inline uint16_t CPU::get_r16(void) {
+        if constexpr (r16 == R16::bc) return bc.pair;
+        else if constexpr (r16 == R16::de) return de.pair;
+        else if constexpr (r16 == R16::hl) return hl.pair;
+        else return sp;
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    template <R16 r16>
+    inline void CPU::set_r16(uint16_t value) {
+        if constexpr (r16 == R16::bc) bc.pair = value;
+        else if constexpr (r16 == R16::de) de.pair = value;
+        else if constexpr (r16 == R16::hl) hl.pair = value;
+        else sp = value;
     }
 
-    std::expected<void, GameBoyError> CPU::set_r16(
-        uint8_t r16, uint16_t value
-    ) {
+    template <R16Stk r16stk>
+    inline uint16_t CPU::get_r16stk(void) {
+        if constexpr (r16stk == R16Stk::bc) return bc.pair;
+        else if constexpr (r16stk == R16Stk::de) return de.pair;
+        else if constexpr (r16stk == R16Stk::hl) return hl.pair;
+        else return af.pair;
+    }
 
-        switch (r16) {
-            case 0:
-                bc.pair = value;
-                return {};
-            case 1:
-                de.pair = value;
-                return {};
-            case 2:
-                hl.pair = value;
-                return {};
-            case 3:
-                sp = value;
-                return {};
-        }
+    template <R16Stk r16stk>
+    inline void CPU::set_r16stk(uint16_t value) {
+        if constexpr (r16stk == R16Stk::bc) bc.pair = value;
+        else if constexpr (r16stk == R16Stk::de) de.pair = value;
+        else if constexpr (r16stk == R16Stk::hl) hl.pair = value;
+        // The lower nibble of F is hardwired to zero
+        else af.pair = value & 0xfff0;
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    template <R16Mem r16mem>
+    inline uint16_t CPU::get_r16mem(void) {
+        if constexpr (r16mem == R16Mem::bc) return bc.pair;
+        else if constexpr (r16mem == R16Mem::de) return de.pair;
+        else if constexpr (r16mem == R16Mem::hl_p) return hl.pair++;
+        else return hl.pair--;
     }
 
-    std::expected<uint16_t, GameBoyError> CPU::get_r16stk(uint8_t r16) {
-        switch (r16) {
-            case 0:
-                return bc.pair;
-            case 1:
-                return de.pair;
-            case 2:
-                return hl.pair;
-            case 3:
-                return af.pair;
-        }
+    template <Cond cond>
+    inline bool CPU::get_cond(void) {
+        if constexpr (cond == Cond::nz) return !get_flag_z();
+        else if constexpr (cond == Cond::z) return get_flag_z();
+        else if constexpr (cond == Cond::nc) return !get_flag_c();
+        else return get_flag_c();
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    inline uint8_t CPU::fetch_byte(void) {
+        return bus.read(pc++);
     }
 
-    std::expected<void, GameBoyError> CPU::set_r16stk(
-        uint8_t r16, uint16_t value
-    ) {
-        switch (r16) {
-            case 0:
-                bc.pair = value;
-                return {};
-            case 1:
-                de.pair = value;
-                return {};
-            case 2:
-                hl.pair = value;
-                return {};
-            case 3:
-                af.pair = value;
-                return {};
-        }
+    inline uint16_t CPU::fetch_word(void) {
+        auto value = load_word(pc);
+        pc += 2;
+        return value;
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    inline uint16_t CPU::load_word(uint16_t address) {
+        auto l = bus.read(address);
+        auto h = bus.read(address + 1);
+        return (static_cast<uint16_t>(h) << 8) | l;
     }
 
-    std::expected<uint16_t, GameBoyError> CPU::get_r16mem(uint8_t r16) {
-        switch (r16) {
-            case 0:
-                return bc.pair;
-            case 1:
-                return de.pair;
-            case 2:
-                return ++hl.pair;
-            case 3:
-                return --hl.pair;
-        }
+    inline void CPU::store_word(uint16_t address, uint16_t value) {
+        bus.write(address, value & 0xff);
+        bus.write(address + 1, value >> 8);
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    inline void CPU::push_word(uint16_t value) {
+        sp -= 2;
+        store_word(sp, value);
     }
 
-    std::expected<void, GameBoyError> CPU::set_r16mem(
-        uint8_t r16, uint16_t value
-    ) {
+    inline uint16_t CPU::pop_word(void) {
+        auto value = load_word(sp);
+        sp += 2;
+        return value;
+    }
 
-        switch (r16) {
-            case 0:
-                bc.pair = value;
-                return {};
-            case 1:
-                de.pair = value;
-                return {};
-            case 2:
-            case 3:
-                hl.pair = value;
-                return {};
-        }
+    inline void CPU::alu_add(uint8_t value, bool carry) {
+        auto a_value = get_a();
+        unsigned sum = a_value + value + carry;
+        set_a(sum);
+        set_flag_z((sum & 0xff) == 0);
+        set_flag_n(false);
+        set_flag_h((a_value & 0xf) + (value & 0xf) + carry > 0xf);
+        set_flag_c(sum > 0xff);
+    }
 
-        return std::unexpected(GameBoyError::invalid_register);
+    inline void CPU::alu_sub(uint8_t value, bool carry) {
+        auto a_value = get_a();
+        int difference = a_value - value - carry;
+        set_a(difference);
+        set_flag_z((difference & 0xff) == 0);
+        set_flag_n(true);
+        set_flag_h((a_value & 0xf) - (value & 0xf) - carry < 0);
+        set_flag_c(difference < 0);
     }
 
-    std::expected<bool, GameBoyError> CPU::get_cond(uint8_t cond) {
-        switch (cond) {
-            case 0:
-                return !get_flag_z();
-            case 1:
-                return get_flag_z();
-            case 2:
-                return !get_flag_c();
-            case 3:
-                return get_flag_c();
-        }
+    inline void CPU::alu_and(uint8_t value) {
+        auto result = get_a() & value;
+        set_a(result);
+        set_flag_z(result == 0);
+        set_flag_n(false);
+        set_flag_h(true);
+        set_flag_c(false);
+    }
 
-        return std::unexpected(GameBoyError::invalid_cond);
+    inline void CPU::alu_xor(uint8_t value) {
+        auto result = get_a() ^ value;
+        set_a(result);
+        set_flag_z(result == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(false);
     }
 
-    std::expected<uint16_t, GameBoyError> CPU::load_word(uint16_t address) {
-        auto l = bus.read(address);
-        auto h = bus.read(address + 1);
-        return (static_cast<uint16_t>(h) << 8) | l;
+    inline void CPU::alu_or(uint8_t value) {
+        auto result = get_a() | value;
+        set_a(result);
+        set_flag_z(result == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(false);
     }
 
-    std::expected<void, GameBoyError> CPU::store_word(
-        uint16_t address, uint16_t value
-    ) {
-        bus.write(address, value & 0xff);
-        bus.write(address + 1, value >> 8);
-        return {};
+    inline void CPU::alu_cp(uint8_t value) {
+        auto a_value = get_a();
+        alu_sub(value, false);
+        set_a(a_value);
     }
 
-    std::expected<void, GameBoyError> CPU::ld_r16_imm16(uint8_t opcode) { 
-        uint8_t dest = (opcode >> 4) & 0b11;
-
-        return load_word(pc)
-            .and_then([this, dest](uint16_t imm) {
-                return set_r16(dest, imm); 
-            })
-            .transform([this]() {
-                pc += 2;
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::ld_r16mem_a(uint8_t opcode) { 
-        uint8_t dest = (opcode >> 4) & 0b11;
-
-        return get_r16mem(dest)
-            .transform([this](uint16_t r16mem) {
-                return bus.write(
-                    r16mem, 
-                    get_a()
-                );
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::ld_a_r16mem(uint8_t opcode) { 
-        uint8_t source = (opcode >> 4) & 0b11;
-
-        return get_r16mem(source)
-            .transform([this](uint16_t r16mem) {
-                auto value = bus.read(r16mem);
-                set_a(value);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::ld_imm16_sp(uint8_t opcode) { 
-        return load_word(pc)
-            .and_then([this](uint16_t imm16) {
-                return store_word(imm16, sp);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::inc_r16(uint8_t opcode) { 
-        uint8_t operand = (opcode >> 4) & 0b11;
-        
-        return get_r16(operand)
-            .and_then([this, operand](uint16_t r16) {
-                return set_r16(operand, r16 + 1);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::dec_r16(uint8_t opcode) { 
-        uint8_t operand = (opcode >> 4) & 0b11;
-        
-        return get_r16(operand)
-            .and_then([this, operand](uint16_t r16) {
-                return set_r16(operand, r16 - 1);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::add_hl_r16(uint8_t opcode) {
-        uint8_t operand = (opcode >> 4) & 0b11;
-        
-        return get_r16(operand)
-            .transform([this](uint16_t r16) {
-                auto hl_value = hl.pair;
-                hl.pair += r16;
-                set_flag_n(false);
-                set_flag_h((hl_value & 0xFF) > (hl.pair & 0xFF));
-                set_flag_c(hl_value > hl.pair);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::inc_r8(uint8_t opcode) { 
-        uint8_t operand = (opcode >> 4) & 0b11;
-        
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto next_value = r8 + 1;
-                *set_r8(operand, next_value);
-                set_flag_z(next_value == 0);
-                set_flag_n(false);
-                set_flag_h((r8 & 0xF) > (next_value & 0xF));
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::dec_r8(uint8_t opcode) {
-        uint8_t operand = (opcode >> 4) & 0b11;
-        
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto next_value = r8 - 1;
-                *set_r8(operand, r8 + 1);
-                set_flag_z(next_value == 0);
-                set_flag_n(true);
-                set_flag_h((r8 & 0xF) == 0);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::ld_r8_imm8(uint8_t opcode) { 
-        uint8_t dest = (opcode >> 4) & 0b11;
-        
-        auto imm8 = bus.read(pc);
-        set_r8(dest, imm8);
-        return {};
+    void CPU::nop(void) {
     }
 
-    std::expected<void, GameBoyError> CPU::rlca(uint8_t opcode) { 
+    template <R16 dest>
+    void CPU::ld_r16_imm16(void) {
+        set_r16<dest>(fetch_word());
+    }
+
+    template <R16Mem dest>
+    void CPU::ld_r16mem_a(void) {
+        bus.write(get_r16mem<dest>(), get_a());
+    }
+
+    template <R16Mem source>
+    void CPU::ld_a_r16mem(void) {
+        set_a(bus.read(get_r16mem<source>()));
+    }
+
+    void CPU::ld_imm16_sp(void) {
+        store_word(fetch_word(), sp);
+    }
+
+    template <R16 operand>
+    void CPU::inc_r16(void) {
+        set_r16<operand>(get_r16<operand>() + 1);
+    }
+
+    template <R16 operand>
+    void CPU::dec_r16(void) {
+        set_r16<operand>(get_r16<operand>() - 1);
+    }
+
+    template <R16 operand>
+    void CPU::add_hl_r16(void) {
+        auto hl_value = hl.pair;
+        auto r16 = get_r16<operand>();
+        hl.pair = hl_value + r16;
+        set_flag_n(false);
+        set_flag_h((hl_value & 0xfff) + (r16 & 0xfff) > 0xfff);
+        set_flag_c(hl_value + r16 > 0xffff);
+    }
+
+    template <R8 operand>
+    void CPU::inc_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t next_value = r8 + 1;
+        set_r8<operand>(next_value);
+        set_flag_z(next_value == 0);
+        set_flag_n(false);
+        set_flag_h((r8 & 0xf) == 0xf);
+    }
+
+    template <R8 operand>
+    void CPU::dec_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t next_value = r8 - 1;
+        set_r8<operand>(next_value);
+        set_flag_z(next_value == 0);
+        set_flag_n(true);
+        set_flag_h((r8 & 0xf) == 0);
+    }
+
+    template <R8 dest>
+    void CPU::ld_r8_imm8(void) {
+        set_r8<dest>(fetch_byte());
+    }
+
+    void CPU::rlca(void) {
         auto a_value = get_a();
-        set_a(a_value << 1);
+        set_a((a_value << 1) | (a_value >> 7));
         set_flag_c((a_value & 0x80) != 0);
         set_flag_z(false);
         set_flag_n(false);
         set_flag_h(false);
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::rrca(uint8_t opcode) {
+    void CPU::rrca(void) {
         auto a_value = get_a();
-        set_a(a_value >> 1);
+        set_a((a_value >> 1) | (a_value << 7));
         set_flag_c((a_value & 1) != 0);
         set_flag_z(false);
         set_flag_n(false);
         set_flag_h(false);
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::rla(uint8_t opcode) { 
+    void CPU::rla(void) {
         auto a_value = get_a();
         auto c_value = get_flag_c();
         set_a((a_value << 1) | c_value);
@@ -381,10 +550,9 @@ namespace emulator {
         set_flag_z(false);
         set_flag_n(false);
         set_flag_h(false);
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::rra(uint8_t opcode) { 
+    void CPU::rra(void) {
         auto a_value = get_a();
         auto c_value = get_flag_c();
         set_a((a_value >> 1) | (static_cast<uint8_t>(c_value) << 7));
@@ -392,850 +560,1089 @@ namespace emulator {
         set_flag_z(false);
         set_flag_n(false);
         set_flag_h(false);
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::daa(uint8_t opcode) { 
-        uint8_t adjustment = 0;
+    void CPU::daa(void) {
         auto a_value = get_a();
 
         if (get_flag_n()) {
-            if (get_flag_h()) {
-                adjustment += 6;
-            }
-
             if (get_flag_c()) {
-                adjustment += 0x60;
+                a_value -= 0x60;
             }
 
-            a_value -= adjustment;
-        } else {
-            if (get_flag_h() || (a_value & 0xf) > 9) {
-                adjustment += 6;
+            if (get_flag_h()) {
+                a_value -= 6;
             }
-
+        } else {
             if (get_flag_c() || a_value > 0x99) {
-                adjustment += 0x60;
+                a_value += 0x60;
                 set_flag_c(true);
             }
 
-            a_value += adjustment;
+            if (get_flag_h() || (a_value & 0xf) > 9) {
+                a_value += 6;
+            }
         }
 
+        set_a(a_value);
         set_flag_z(a_value == 0);
         set_flag_h(false);
-
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::cpl(uint8_t opcode) { 
+    void CPU::cpl(void) {
         set_a(~get_a());
         set_flag_n(true);
         set_flag_h(true);
-
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::scf(uint8_t opcode) {
+    void CPU::scf(void) {
         set_flag_n(false);
         set_flag_h(false);
         set_flag_c(true);
-
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::ccf(uint8_t opcode) {
+    void CPU::ccf(void) {
         set_flag_n(false);
         set_flag_h(false);
         set_flag_c(!get_flag_c());
-        
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::jr_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        pc += 1 + static_cast<int8_t>(imm8);
-        return {};
+    void CPU::jr_imm8(void) {
+        auto imm8 = static_cast<int8_t>(fetch_byte());
+        pc += imm8;
     }
 
-    std::expected<void, GameBoyError> CPU::jr_cond_imm8(uint8_t opcode) { 
-        auto cond_code = (opcode >> 3) & 0b11;
+    /*
+     * Conditional branches are accounted as not taken; taking them costs the
+     * extra M-cycles of taken_cycles.
+     */
+    template <Cond cond>
+    void CPU::jr_cond_imm8(void) {
+        auto imm8 = static_cast<int8_t>(fetch_byte());
 
-        auto cond = get_cond(cond_code);
+        if (get_cond<cond>()) {
+            pc += imm8;
+            sync.tick_cpu(4);
+        }
+    }
+
+    /*
+     * Only the CGB speed switch is supported. The CPU stays stopped for
+     * about 2050 M-cycles meanwhile, counted at the speed it switched from.
+     */
+    void CPU::stop(void) {
+        auto shift = sync.get_speed_shift();
 
-        if (!cond) {
-            return std::unexpected(cond.error());
+        if (bus.switch_speed()) {
+            pc++;
+            sync.tick((2050 * 4) >> shift);
+            return;
         }
 
-        if (*cond) {
-            auto imm8 = bus.read(pc);
-            pc += 1 + static_cast<int8_t>(imm8);
+        // TODO: implement stop
+        raise(GameBoyError::unimplemented);
+    }
+
+    template <R8 dest, R8 source>
+    void CPU::ld_r8_r8(void) {
+        set_r8<dest>(get_r8<source>());
+    }
+
+    /*
+     * With IME clear and an interrupt already pending HALT doesn't halt, and
+     * the next opcode is fetched without advancing pc, so its first byte is
+     * read twice.
+     */
+    void CPU::halt(void) {
+        if (interrupts.get_ime() || !interrupts.get_pending()) {
+            halted = true;
+            return;
         }
 
-        return {};
+        decode_execute(bus.read(pc));
     }
 
-    // TODO: implement stop
-    std::expected<void, GameBoyError> CPU::stop(uint8_t opcode) { 
-        return std::unexpected(GameBoyError::unimplemented);
-    }
-
-    std::expected<void, GameBoyError> CPU::ld_r8_r8(uint8_t opcode) { 
-        auto source = opcode & 0b111;
-        auto dest = (opcode >> 3) & 0b111;
+    template <R8 operand>
+    void CPU::add_a_r8(void) {
+        alu_add(get_r8<operand>(), false);
+    }
 
-        return get_r8(source)
-            .and_then([this, dest](uint8_t r8) {
-                return set_r8(dest, r8);
-            });
-    }
-
-    // TODO: implement halt
-    std::expected<void, GameBoyError> CPU::halt(uint8_t opcode) { 
-        return std::unexpected(GameBoyError::unimplemented);
-    }
-
-    std::expected<void, GameBoyError> CPU::add_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto a_value = get_a();
-                auto sum = a_value + r8;
-                set_a(sum);
-                set_flag_z(sum == 0);
-                set_flag_n(false);
-                set_flag_h((a_value & 0xf) > (sum & 0xf));
-                set_flag_c(a_value > sum);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::adc_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto a_value = get_a();
-                auto sum = a_value + r8 + get_flag_c();
-                set_a(sum);
-                set_flag_z(sum == 0);
-                set_flag_n(false);
-                set_flag_h((a_value & 0xf) > (sum & 0xf));
-                set_flag_c(a_value > sum);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::sub_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto a_value = get_a();
-                auto sum = a_value - r8;
-                set_a(sum);
-                set_flag_z(sum == 0);
-                set_flag_n(true);
-                set_flag_h((r8 & 0xf) > (a_value & 0xf));
-                set_flag_c(r8 > a_value);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::sbc_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto a_value = get_a();
-                auto sum = a_value - (r8 + 1);
-                set_a(sum);
-                set_flag_z(sum == 0);
-                set_flag_n(false);
-                set_flag_h(((r8 + 1) & 0xf) > (a_value & 0xf));
-                set_flag_c((r8 + 1) > a_value);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::and_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto result = get_a() & r8;
-                set_a(result);
-                set_flag_z(result == 0);
-                set_flag_n(false);
-                set_flag_h(true);
-                set_flag_c(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::xor_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto result = get_a() ^ r8;
-                set_a(result);
-                set_flag_z(result == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::or_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto result = get_a() | r8;
-                set_a(result);
-                set_flag_z(result == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::cp_a_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this](uint8_t r8) {
-                auto a_value = get_a();
-                auto sum = a_value - r8;
-                set_flag_z(sum == 0);
-                set_flag_n(true);
-                set_flag_h((r8 & 0xf) > (a_value & 0xf));
-                set_flag_c(r8 > a_value);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::add_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto a_value = get_a();
-        auto sum = a_value + imm8;
-        set_a(sum);
-        set_flag_z(sum == 0);
+    template <R8 operand>
+    void CPU::adc_a_r8(void) {
+        alu_add(get_r8<operand>(), get_flag_c());
+    }
+
+    template <R8 operand>
+    void CPU::sub_a_r8(void) {
+        alu_sub(get_r8<operand>(), false);
+    }
+
+    template <R8 operand>
+    void CPU::sbc_a_r8(void) {
+        alu_sub(get_r8<operand>(), get_flag_c());
+    }
+
+    template <R8 operand>
+    void CPU::and_a_r8(void) {
+        alu_and(get_r8<operand>());
+    }
+
+    template <R8 operand>
+    void CPU::xor_a_r8(void) {
+        alu_xor(get_r8<operand>());
+    }
+
+    template <R8 operand>
+    void CPU::or_a_r8(void) {
+        alu_or(get_r8<operand>());
+    }
+
+    template <R8 operand>
+    void CPU::cp_a_r8(void) {
+        alu_cp(get_r8<operand>());
+    }
+
+    void CPU::add_a_imm8(void) {
+        alu_add(fetch_byte(), false);
+    }
+
+    void CPU::adc_a_imm8(void) {
+        alu_add(fetch_byte(), get_flag_c());
+    }
+
+    void CPU::sub_a_imm8(void) {
+        alu_sub(fetch_byte(), false);
+    }
+
+    void CPU::sbc_a_imm8(void) {
+        alu_sub(fetch_byte(), get_flag_c());
+    }
+
+    void CPU::and_a_imm8(void) {
+        alu_and(fetch_byte());
+    }
+
+    void CPU::xor_a_imm8(void) {
+        alu_xor(fetch_byte());
+    }
+
+    void CPU::or_a_imm8(void) {
+        alu_or(fetch_byte());
+    }
+
+    void CPU::cp_a_imm8(void) {
+        alu_cp(fetch_byte());
+    }
+
+    template <Cond cond>
+    void CPU::ret_cond(void) {
+        if (get_cond<cond>()) {
+            pc = pop_word();
+            sync.tick_cpu(12);
+        }
+    }
+
+    void CPU::ret(void) {
+        pc = pop_word();
+    }
+
+    void CPU::reti(void) {
+        interrupts.enable_now();
+        pc = pop_word();
+    }
+
+    template <Cond cond>
+    void CPU::jp_cond_imm16(void) {
+        auto imm16 = fetch_word();
+
+        if (get_cond<cond>()) {
+            pc = imm16;
+            sync.tick_cpu(4);
+        }
+    }
+
+    void CPU::jp_imm16(void) {
+        pc = fetch_word();
+    }
+
+    void CPU::jp_hl(void) {
+        pc = hl.pair;
+    }
+
+    template <Cond cond>
+    void CPU::call_cond_imm16(void) {
+        auto imm16 = fetch_word();
+
+        if (get_cond<cond>()) {
+            push_word(pc);
+            pc = imm16;
+            sync.tick_cpu(12);
+        }
+    }
+
+    void CPU::call_imm16(void) {
+        auto imm16 = fetch_word();
+        push_word(pc);
+        pc = imm16;
+    }
+
+    template <uint8_t tgt3>
+    void CPU::rst_tgt3(void) {
+        push_word(pc);
+        pc = tgt3 << 3;
+    }
+
+    template <R16Stk reg>
+    void CPU::pop_r16stk(void) {
+        set_r16stk<reg>(pop_word());
+    }
+
+    template <R16Stk reg>
+    void CPU::push_r16stk(void) {
+        push_word(get_r16stk<reg>());
+    }
+
+    void CPU::ldh_c_a(void) {
+        bus.write(0xff00 | get_c(), get_a());
+    }
+
+    void CPU::ldh_imm8_a(void) {
+        bus.write(0xff00 | fetch_byte(), get_a());
+    }
+
+    void CPU::ld_imm16_a(void) {
+        bus.write(fetch_word(), get_a());
+    }
+
+    void CPU::ldh_a_c(void) {
+        set_a(bus.read(0xff00 | get_c()));
+    }
+
+    void CPU::ldh_a_imm8(void) {
+        set_a(bus.read(0xff00 | fetch_byte()));
+    }
+
+    void CPU::ld_a_imm16(void) {
+        set_a(bus.read(fetch_word()));
+    }
+
+    void CPU::add_sp_imm8(void) {
+        auto imm8 = fetch_byte();
+        auto sp_value = sp;
+        sp += static_cast<int8_t>(imm8);
+        set_flag_z(false);
         set_flag_n(false);
-        set_flag_h((a_value & 0xf) > (sum & 0xf));
-        set_flag_c(a_value > sum);
-        pc++;
-        return {};
+        set_flag_h((sp_value & 0xf) + (imm8 & 0xf) > 0xf);
+        set_flag_c((sp_value & 0xff) + imm8 > 0xff);
     }
 
-    std::expected<void, GameBoyError> CPU::adc_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto a_value = get_a();
-        auto sum = a_value + imm8 + get_flag_c();
-        set_a(sum);
-        set_flag_z(sum == 0);
+    void CPU::ld_hl_sp_imm8(void) {
+        auto imm8 = fetch_byte();
+        hl.pair = sp + static_cast<int8_t>(imm8);
+        set_flag_z(false);
         set_flag_n(false);
-        set_flag_h((a_value & 0xf) > (sum & 0xf));
-        set_flag_c(a_value > sum);
-        pc++;
-        return {};
+        set_flag_h((sp & 0xf) + (imm8 & 0xf) > 0xf);
+        set_flag_c((sp & 0xff) + imm8 > 0xff);
     }
 
-    std::expected<void, GameBoyError> CPU::sub_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto a_value = get_a();
-        auto sum = a_value - imm8;
-        set_a(sum);
-        set_flag_z(sum == 0);
-        set_flag_n(true);
-        set_flag_h((imm8 & 0xf) > (a_value & 0xf));
-        set_flag_c(imm8 > a_value);
-        pc++;
-        return {};
+    void CPU::ld_sp_hl(void) {
+        sp = hl.pair;
     }
 
-    std::expected<void, GameBoyError> CPU::sbc_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto a_value = get_a();
-        auto sum = a_value - (imm8 + 1);
-        set_a(sum);
-        set_flag_z(sum == 0);
+    void CPU::di(void) {
+        interrupts.disable();
+    }
+
+    void CPU::ei(void) {
+        interrupts.enable();
+    }
+
+    // Illegal opcodes lock the CPU up, which the sticky fault reproduces
+    void CPU::hard_lock(void) {
+        raise(GameBoyError::invalid_instruction);
+    }
+
+    template <R8 operand>
+    void CPU::rlc_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = (r8 << 1) | (r8 >> 7);
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
         set_flag_n(false);
-        set_flag_h(((imm8 + 1) & 0xf) > (a_value & 0xf));
-        set_flag_c((imm8 + 1) > a_value);
-        pc++;
-        return {};
+        set_flag_h(false);
+        set_flag_c(r8 >> 7);
     }
 
-    std::expected<void, GameBoyError> CPU::and_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto result = get_a() & imm8;
-        set_a(result);
-        set_flag_z(result == 0);
+    template <R8 operand>
+    void CPU::rrc_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = (r8 >> 1) | (r8 << 7);
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
         set_flag_n(false);
-        set_flag_h(true);
-        set_flag_c(false);
-        pc++;
-        return {};
+        set_flag_h(false);
+        set_flag_c(r8 & 1);
     }
 
-    std::expected<void, GameBoyError> CPU::xor_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto result = get_a() ^ imm8;
-        set_a(result);
-        set_flag_z(result == 0);
+    template <R8 operand>
+    void CPU::rl_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = (r8 << 1) | get_flag_c();
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
         set_flag_n(false);
         set_flag_h(false);
-        set_flag_c(false);
-        pc++;
-        return {};
+        set_flag_c(r8 >> 7);
     }
 
-    std::expected<void, GameBoyError> CPU::or_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto result = get_a() | imm8;
-        set_a(result);
-        set_flag_z(result == 0);
+    template <R8 operand>
+    void CPU::rr_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = (r8 >> 1) | (get_flag_c() << 7);
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(r8 & 1);
+    }
+
+    template <R8 operand>
+    void CPU::sla_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = r8 << 1;
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(r8 >> 7);
+    }
+
+    template <R8 operand>
+    void CPU::sra_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = (r8 >> 1) | (r8 & 0x80);
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(r8 & 1);
+    }
+
+    template <R8 operand>
+    void CPU::swap_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t swap = (r8 << 4) | (r8 >> 4);
+        set_r8<operand>(swap);
+        set_flag_z(swap == 0);
         set_flag_n(false);
         set_flag_h(false);
         set_flag_c(false);
-        pc++;
-        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::cp_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto a_value = get_a();
-        auto sum = a_value - imm8;
-        set_flag_z(sum == 0);
-        set_flag_n(true);
-        set_flag_h((imm8 & 0xf) > (a_value & 0xf));
-        set_flag_c(imm8 > a_value);
-        pc++;
-        return {};
+    template <R8 operand>
+    void CPU::srl_r8(void) {
+        auto r8 = get_r8<operand>();
+        uint8_t shift = r8 >> 1;
+        set_r8<operand>(shift);
+        set_flag_z(shift == 0);
+        set_flag_n(false);
+        set_flag_h(false);
+        set_flag_c(r8 & 1);
     }
 
-    std::expected<void, GameBoyError> CPU::ret_cond(uint8_t opcode) { 
-        auto cond_code = (opcode >> 3) & 0b11;
+    template <uint8_t bit3, R8 operand>
+    void CPU::bit_b3_r8(void) {
+        set_flag_z(((get_r8<operand>() >> bit3) & 1) == 0);
+        set_flag_n(false);
+        set_flag_h(true);
+    }
+
+    template <uint8_t bit3, R8 operand>
+    void CPU::res_b3_r8(void) {
+        set_r8<operand>(get_r8<operand>() & ~(1 << bit3));
+    }
+
+    template <uint8_t bit3, R8 operand>
+    void CPU::set_b3_r8(void) {
+        set_r8<operand>(get_r8<operand>() | (1 << bit3));
+    }
 
-        auto cond = get_cond(cond_code);
+    void CPU::cb_prefix(void) {
+        auto opcode = fetch_byte();
+#ifdef GUB_PROFILE
+        profiled_opcode = 0x100 | opcode;
+#endif
+        (this->*cb_table[opcode])();
+        sync.tick_cpu(cb_cycles[opcode]);
+    }
+
+    /*
+     * Faults are sticky: the faulting instruction is left under pc, so any
+     * step taken after it faults again without touching the machine state.
+     * That lets run() execute until the next event and only check for a
+     * fault then.
+     */
+    [[gnu::cold]] void CPU::raise(GameBoyError error) {
+        pc--;
+        fault = error;
+    }
 
-        if (!cond) {
-            return std::unexpected(cond.error());
+    inline void CPU::decode_execute(uint8_t opcode) {
+        (this->*op_table[opcode])();
+        sync.tick_cpu(op_cycles[opcode]);
+    }
+
+    bool CPU::build_block(Block &block, const uint8_t *key) {
+        uint16_t loop_cycles = 0;
+
+        if (pc >= 0xc000) {
+            if (uncached_code & (1u << ((pc - 0xc000) >> 8))) {
+                return false;
+            }
+
+            bus.watch_code(pc);
         }
 
-        if (*cond) {
-            return load_word(sp)
-                .transform([this](uint8_t stk) {
-                    pc = stk;
-                    sp += 2;
-                });
+        // Whole instructions only, and never past the page the key is in
+        size_t end = 0x100 - (pc & 0xff);
+        size_t offset = 0;
+
+        block.key = key;
+        block.count = 0;
+
+        while (block.count < block.ops.size()) {
+            auto opcode = key[offset];
+            auto length = instruction_length(opcode);
+
+            if (offset + length > end) {
+                break;
+            }
+
+            auto &op = block.ops[block.count++];
+
+            if (opcode == 0xcb) {
+                auto cb_opcode = key[offset + 1];
+
+                op = MicroOp{
+                    cb_table[cb_opcode], 2,
+                    uint8_t(op_cycles[opcode] + cb_cycles[cb_opcode])
+                };
+            } else {
+                op = MicroOp{ op_table[opcode], 1, op_cycles[opcode] };
+            }
+
+            loop_cycles += op.cycles;
+            offset += length;
+
+            if (ends_block(opcode)) {
+                // A polling loop always takes the branch closing it
+                loop_cycles += taken_cycles(opcode);
+                break;
+            }
         }
 
-        return {};
+        if (!block.count) {
+            block.key = nullptr;
+            return false;
+        }
+
+        block.loop_cycles = is_idle_loop(key, offset, pc) ? loop_cycles : 0;
+
+        return true;
     }
 
-    std::expected<void, GameBoyError> CPU::ret(uint8_t opcode) { 
-        return load_word(sp)
-            .transform([this](uint8_t stk) {
-                pc = stk;
-                sp += 2;
-            });
+    // Pages of the switchable bank cover the blocks cached from every bank
+    void CPU::invalidate_blocks(uint32_t pages) {
+        if (!pages) {
+            return;
+        }
+
+        for (auto &block : *blocks) {
+            if (pages & bus.get_code_page_mask(block.key)) {
+                block.key = nullptr;
+            }
+        }
     }
-    
-    std::expected<void, GameBoyError> CPU::reti(uint8_t opcode) { 
-        ime = 1;
-        return load_word(sp)
-            .transform([this](uint8_t stk) {
-                pc = stk;
-                sp += 2;
-            });
+
+    // Code that keeps rewriting itself costs more to cache than to interpret
+    [[gnu::cold]] void CPU::handle_code_writes(void) {
+        auto pages = bus.take_code_writes();
+
+        for (size_t page = 0; page < code_rewrites.size(); page++) {
+            if ((pages & (1u << page)) &&
+                ++code_rewrites[page] == max_code_rewrites) {
+                uncached_code |= 1u << page;
+            }
+        }
+
+        invalidate_blocks(pages);
     }
 
-    std::expected<void, GameBoyError> CPU::jp_cond_imm16(uint8_t opcode) { 
-        auto cond_code = (opcode >> 3) & 0b11;
+    /*
+     * Runs the cached block at pc, building it first if needed. Returns false
+     * when the code at pc can't be cached, leaving it to the interpreter.
+     */
+    inline bool CPU::execute_block(void) {
+        constexpr int hash_shift = 64 - std::countr_zero(block_cache_size);
 
-        auto cond = get_cond(cond_code);
+        auto key = bus.get_code_address(pc);
 
-        if (!cond) {
-            return std::unexpected(cond.error());
+        if (!key) {
+            return false;
         }
 
-        if (*cond) {
-            return load_word(pc)
-                .transform([this](uint16_t imm16) {
-                    pc = imm16;
-                });
+        if (bus.has_code_writes()) [[unlikely]] {
+            handle_code_writes();
         }
 
-        return {};
+        auto hash = (reinterpret_cast<uintptr_t>(key) * 0x9e3779b97f4a7c15) >>
+            hash_shift;
+        auto &block = (*blocks)[hash];
+
+        if (block.key != key && !build_block(block, key)) {
+            return false;
+        }
+
+        auto start = pc;
+
+        for (size_t i = 0; i < block.count; i++) {
+            auto &op = block.ops[i];
+
+            pc += op.opcode_length;
+            (this->*op.handler)();
+            sync.tick_cpu(op.cycles);
+
+            /*
+             * Events, faults, writes to cached code and writes to IF or IE
+             * that leave an interrupt to dispatch end the block early
+             */
+            if (sync.reached_deadline() || fault || bus.has_code_writes() ||
+                interrupts.is_ready()) [[unlikely]] {
+                return true;
+            }
+        }
+
+        /*
+         * A polling loop that just went around once will keep going around
+         * the same way until the next event, so skip every iteration that
+         * would end by then. The one the event lands in runs normally.
+         */
+        if (block.loop_cycles && pc == start) {
+            uint64_t loop_time = block.loop_cycles >> sync.get_speed_shift();
+            auto iterations =
+                (sync.get_deadline() - sync.get_now()) / loop_time;
+
+            sync.tick_cpu(iterations * block.loop_cycles);
+        }
+
+        return true;
+    }
+
+    /*
+     * Taken at an instruction boundary while the controller is ready.
+     * Dispatching pushes pc and jumps to the vector of the highest priority
+     * interrupt pending, in 5 M-cycles. The push can itself overwrite IE: if
+     * its high byte leaves nothing pending, dispatch is cancelled and
+     * execution goes to 0x0000 instead. Returns whether it dispatched;
+     * otherwise a delayed EI has just taken effect.
+     */
+    bool CPU::handle_interrupts(void) {
+        if (!interrupts.get_ime()) {
+            interrupts.finish_enable();
+            return false;
+        }
+
+        sp--;
+        bus.write(sp, pc >> 8);
+
+        auto pending = interrupts.get_pending();
+        uint8_t mask = pending & -pending;
+
+        sp--;
+        bus.write(sp, pc & 0xff);
+
+        interrupts.acknowledge(mask);
+        pc = mask ? 0x40 + std::countr_zero(mask) * 8 : 0x0000;
+        sync.tick_cpu(20);
+
+#ifdef GUB_PROFILE
+        bus.get_profiler().enter(bus.get_location(pc));
+#endif
+
+        return true;
     }
 
-    std::expected<void, GameBoyError> CPU::jp_imm16(uint8_t opcode) { 
-        return load_word(pc)
-            .transform([this](uint16_t imm16) {
-                pc = imm16;
-            });
+    /*
+     * While halted nothing happens until an event requests an interrupt, so
+     * time jumps straight to the next deadline, in whole M-cycles of the
+     * current speed.
+     */
+    void CPU::idle_until_event(void) {
+        auto deadline = sync.get_deadline();
+        uint64_t m_cycle = 4 >> sync.get_speed_shift();
+        [[maybe_unused]] auto start = sync.get_now();
+
+        if (deadline == Synchronizer::never) {
+            sync.tick(m_cycle);
+        } else if (deadline > sync.get_now()) {
+            sync.tick(
+                (deadline - sync.get_now() + m_cycle - 1) & ~(m_cycle - 1)
+            );
+        }
+
+#ifdef GUB_PROFILE
+        bus.get_profiler().count_idle(sync.get_now() - start);
+#endif
     }
 
-    std::expected<void, GameBoyError> CPU::jp_hl(uint8_t opcode) { 
-        pc = hl.pair;
+    // Leaving HALT takes one M-cycle, whether or not IME is set
+    void CPU::wake(void) {
+        halted = false;
+        sync.tick_cpu(4);
+    }
+
+#ifdef GUB_PROFILE
+    /*
+     * Interprets one instruction and records where it ran, what it was and
+     * what it cost. Profiled builds bypass the block cache and idle-loop
+     * skipping, so counts are those of the guest code as written. Calls and
+     * returns are told apart from their untaken forms by where pc ends up.
+     */
+    void CPU::execute_profiled(void) {
+        auto &profiler = bus.get_profiler();
+        auto start = pc;
+        auto location = bus.get_location(start);
+        auto cycles = sync.get_now();
+
+        profiled_opcode = fetch_byte();
+        decode_execute(profiled_opcode);
+
+        profiler.count_instruction(
+            location, profiled_opcode, sync.get_now() - cycles
+        );
+
+        if (fault) [[unlikely]] {
+            return;
+        }
+
+        switch (profiled_opcode) {
+            case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc: // call
+                if (pc != static_cast<uint16_t>(start + 3)) {
+                    profiler.enter(bus.get_location(pc));
+                }
+
+                break;
+            case 0xc7: case 0xcf: case 0xd7: case 0xdf: case 0xe7: case 0xef:
+            case 0xf7: case 0xff: // rst
+                profiler.enter(bus.get_location(pc));
+                break;
+            case 0xc0: case 0xc8: case 0xc9: case 0xd0: case 0xd8:
+            case 0xd9: // ret, reti
+                if (pc != static_cast<uint16_t>(start + 1)) {
+                    profiler.leave();
+                }
+
+                break;
+        }
+    }
+#endif
+
+    std::expected<void, GameBoyError> CPU::step(void) {
+        if (halted && !interrupts.get_pending()) {
+            idle_until_event();
+        } else {
+            if (halted) {
+                wake();
+            }
+
+            if (!interrupts.is_ready() || !handle_interrupts()) {
+#ifdef GUB_PROFILE
+                execute_profiled();
+#else
+                decode_execute(fetch_byte());
+#endif
+            }
+        }
+
+        bus.handle_events();
+
+        if (fault) [[unlikely]] {
+            return std::unexpected(*fault);
+        }
 
         return {};
     }
 
-    std::expected<void, GameBoyError> CPU::call_cond_imm16(
-        uint8_t opcode
-    ) { 
-        auto cond_code = (opcode >> 3) & 0b11;
+    /*
+     * Runs for the given amount of T-cycles. The inner loop only compares the
+     * clock against the synchronizer deadline, which is the earliest of the
+     * run limit and every pending module event.
+     */
+    std::expected<void, GameBoyError> CPU::run(uint64_t cycles) {
+        auto target = sync.get_now() + cycles;
+
+        sync.set_limit(target);
 
-        auto cond = get_cond(cond_code);
+        while (sync.get_now() < target && !fault) {
+            while (!sync.reached_deadline()) {
+                if (halted) [[unlikely]] {
+                    if (!interrupts.get_pending()) {
+                        idle_until_event();
+                        break;
+                    }
+
+                    wake();
+                }
 
-        if (!cond) {
-            return std::unexpected(cond.error());
+                if (interrupts.is_ready() && handle_interrupts())
+                    [[unlikely]] {
+                    continue;
+                }
+
+#ifdef GUB_PROFILE
+                execute_profiled();
+#else
+                if (!execute_block()) {
+                    decode_execute(fetch_byte());
+                }
+#endif
+            }
+
+            bus.handle_events();
         }
 
-        if (*cond) {
-            return load_word(pc)
-                .and_then([this](uint16_t imm16) {
-                    return store_word(sp - 2, pc + 2)
-                        .transform([this, imm16]() {
-                            sp -= 2;
-                            pc = imm16;
-                        });
-                });
+        sync.set_limit(Synchronizer::never);
+
+        if (fault) [[unlikely]] {
+            return std::unexpected(*fault);
         }
 
         return {};
     }
 
-    std::expected<void, GameBoyError> CPU::call_imm16(uint8_t opcode) { 
-        return load_word(pc)
-            .and_then([this](uint16_t imm16) {
-                return store_word(sp - 2, pc + 2)
-                    .transform([this, imm16]() {
-                        sp -= 2;
-                        pc = imm16;
-                    });
-            });
+    const uint8_t *CPU::get_framebuffer() const {
+        return bus.get_framebuffer();
     }
 
-    // TODO: implement
-    std::expected<void, GameBoyError> CPU::rst_tgt3(uint8_t opcode) { 
-        return std::unexpected(GameBoyError::unimplemented);
+    bool CPU::is_cgb() const {
+        return bus.is_cgb();
     }
 
-    std::expected<void, GameBoyError> CPU::pop_r16stk(uint8_t opcode) { 
-        auto reg = (opcode >> 4) & 0b11;  
-
-        return load_word(sp)
-            .and_then([this, reg](uint16_t stk) {
-                return set_r16stk(reg, stk);
-            })
-            .transform([this]() {
-                sp += 2;
-            });
+    const uint8_t *CPU::get_palettes() const {
+        return bus.get_palettes();
     }
 
-    std::expected<void, GameBoyError> CPU::push_r16stk(uint8_t opcode) { 
-        auto reg = (opcode >> 4) & 0b11;  
+    uint64_t CPU::get_frame_count() const {
+        return bus.get_frame_count();
+    }
 
-        return get_r16stk(reg)
-            .and_then([this](uint16_t r16stk) {
-                return store_word(sp - 2, r16stk);
-            })
-            .transform([this]() {
-                sp -= 2;
-            });
+    const std::string &CPU::get_serial_output() const {
+        return bus.get_serial_output();
     }
 
-    std::expected<void, GameBoyError> CPU::ldh_c_a(uint8_t opcode) { 
-        bus.write(0xff00 + get_c(), get_a());
-        return {};
+    void CPU::set_buttons(uint8_t pressed) {
+        bus.set_buttons(pressed);
     }
 
-    std::expected<void, GameBoyError> CPU::ldh_imm8_a(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        bus.write(0xff00 | imm8, get_a());
-        ++pc;
-        return {};
+    void CPU::set_sample_rate(uint32_t rate) {
+        bus.set_sample_rate(rate);
     }
 
-    std::expected<void, GameBoyError> CPU::ld_imm16_a(uint8_t opcode) { 
-        return load_word(pc)
-            .transform([this](uint16_t imm16) {
-                return bus.write(imm16, get_a());
-                pc += 2;
-            });
+    SampleRing &CPU::get_samples() {
+        return bus.get_samples();
     }
 
-    std::expected<void, GameBoyError> CPU::ldh_a_c(uint8_t opcode) { 
-        auto value = bus.read(0xff00 + get_c());
-        set_a(value);
-        return {};
+    void CPU::set_video_enabled(bool enabled) {
+        bus.set_video_enabled(enabled);
     }
 
-    std::expected<void, GameBoyError> CPU::ldh_a_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto value = bus.read(0xff00 + imm8);
-        set_a(value);
-        pc++;
-        return {};
+    void CPU::set_audio_enabled(bool enabled) {
+        bus.set_audio_enabled(enabled);
     }
 
-    std::expected<void, GameBoyError> CPU::ld_a_imm16(uint8_t opcode) { 
-        return load_word(pc)
-            .transform([this](uint16_t imm16) {
-                auto value = bus.read(imm16);
-                set_a(value);
-                pc += 2;
-            });
+    void CPU::set_accurate_oam_dma(bool enabled) {
+        bus.set_accurate_oam_dma(enabled);
     }
 
-    std::expected<void, GameBoyError> CPU::add_sp_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto sp_value = sp;
-        sp += static_cast<int8_t>(imm8);
-        set_flag_z(false);
-        set_flag_n(false);
-        set_flag_h((sp_value & 0xf) > (sp & 0xf));
-        set_flag_c(sp_value > sp);
-        ++pc;
-        return {};
+    uint64_t CPU::get_cycles() const {
+        return sync.get_now();
     }
 
-    std::expected<void, GameBoyError> CPU::ld_hl_sp_imm8(uint8_t opcode) { 
-        auto imm8 = bus.read(pc);
-        auto sp_value = sp;
-        auto sum = sp + static_cast<int8_t>(imm8);
-        hl.pair = sum;
-        set_flag_z(false);
-        set_flag_n(false);
-        set_flag_h((sp_value & 0xf) > (sum & 0xf));
-        set_flag_c(sp_value > sum);
-        ++pc;
-        return {};
+    uint8_t CPU::peek(uint16_t address) {
+        return bus.read(address);
     }
 
-    std::expected<void, GameBoyError> CPU::ld_sp_hl(uint8_t opcode) { 
-        sp = hl.pair;
+#ifdef GUB_PROFILE
+    Profiler &CPU::get_profiler() {
+        return bus.get_profiler();
+    }
+#endif
 
-        return {};
+    void CPU::save_body(StateWriter &state) const {
+        state.put(af, bc, de, hl, sp, pc, halted);
+        sync.save_state(state);
+        bus.save_state(state);
     }
 
-    std::expected<void, GameBoyError> CPU::di(uint8_t opcode) { 
-        ime = 0;
-        return {};
+    size_t CPU::get_state_size() const {
+        StateWriter counter;
+        save_body(counter);
+
+        return sizeof(StateHeader) + counter.get_size();
     }
 
-    std::expected<void, GameBoyError> CPU::ei(uint8_t opcode) { 
-        ime = 1;
-        return {};
+    void CPU::save_state(uint8_t *buffer) const {
+        StateWriter state(buffer);
+
+        // The header goes in last, once the size is known
+        state.skip(sizeof(StateHeader));
+        save_body(state);
+
+        StateHeader header{ state_magic, state_version, state.get_size() };
+        std::memcpy(buffer, &header, sizeof(header));
     }
 
-    std::expected<void, GameBoyError> CPU::rlc_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto value = get_a();
-                auto shift = value << 1;
-                *set_r8(operand, shift);
-                set_flag_c((value & 0x80) != 0);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::rrc_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto shift = r8 >> 1;
-                *set_r8(operand, shift);
-                set_flag_c((r8 & 0x80) != 0);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::rl_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto c_value = get_flag_c();
-                set_flag_c(r8 >> 7);
-                auto shift = (r8 << 1) | c_value;
-                *set_r8(operand, shift);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::rr_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto c_value = get_flag_c();
-                set_flag_c(r8 & 1);
-                auto shift = (r8 >> 1) | (c_value << 7);
-                *set_r8(operand, shift);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::sla_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto shift = r8 << 1;
-                *set_r8(operand, shift);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(r8 >> 7);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::sra_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto shift = (r8 >> 1) | (r8 & 0x80);
-                *set_r8(operand, shift);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(r8 & 1);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::swap_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto swap = ((r8 & 0xf) << 4) | ((r8 & 0xf0) >> 4);
-                *set_r8(operand, swap);
-                set_flag_z(swap == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(false);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::srl_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111; 
-
-        return get_r8(operand)
-            .transform([this, operand](uint8_t r8) {
-                auto shift = r8 >> 1;
-                *set_r8(operand, shift);
-                set_flag_z(shift == 0);
-                set_flag_n(false);
-                set_flag_h(false);
-                set_flag_c(r8 & 1);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::bit_b3_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-        auto bit3 = (opcode >> 3) & 0b111;
-
-        return get_r8(operand)
-            .transform([this, bit3](uint8_t r8) {
-                set_flag_z(((r8 >> bit3) & 1) == 0); 
-                set_flag_n(false);
-                set_flag_h(true);
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::res_b3_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-        auto bit3 = (opcode >> 3) & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand, bit3](uint8_t r8) {
-                *set_r8(operand, r8 & ~(1 << bit3));
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::set_b3_r8(uint8_t opcode) { 
-        auto operand = opcode & 0b111;
-        auto bit3 = (opcode >> 3) & 0b111;
-
-        return get_r8(operand)
-            .transform([this, operand, bit3](uint8_t r8) {
-                *set_r8(operand, r8 & (1 << bit3));
-            });
-    }
-
-    std::expected<void, GameBoyError> CPU::decode_execute(uint8_t opcode)
-    {
-        auto block = opcode >> 6;
-
-        if (cb_flag) {
-            return cb_prefix(opcode);
-            cb_flag = false;
-        } else {
-            switch (block) {
-                case 0: return block0(opcode);
-                case 1: return block1(opcode);
-                case 2: return block2(opcode);
-                case 3: return block3(opcode);
-            }
-        }
+    std::expected<void, GameBoyError> CPU::load_state(
+        const uint8_t *buffer, size_t size
+    ) {
+        StateHeader header;
 
-        std::unreachable();
-    }
-
-    std::expected<void, GameBoyError> CPU::block0(uint8_t opcode) {
-        auto x = opcode & 0b111;
-        bool y = (opcode >> 3) & 1;
-
-        switch (opcode) {
-            case 0x00: return {};
-            case 0x08: return ld_imm16_sp(opcode);
-            case 0x07: return rlca(opcode);
-            case 0x0f: return rrca(opcode);
-            case 0x17: return rla(opcode);
-            case 0x1f: return rra(opcode);
-            case 0x27: return daa(opcode);
-            case 0x2f: return cpl(opcode);
-            case 0x37: return scf(opcode);
-            case 0x3f: return ccf(opcode);
-            case 0x18: return jr_imm8(opcode);
-            case 0x10: return stop(opcode);
+        if (size < sizeof(header)) {
+            return std::unexpected(GameBoyError::invalid_state);
         }
 
-        switch (x) {
-            case 0b000: return jr_cond_imm8(opcode);
-            case 0b001: 
-                if (!y) {
-                    return ld_r16_imm16(opcode);
-                } else {
-                    return add_hl_r16(opcode);
-                }
-            case 0b010:
-                if (!y) {
-                    return ld_r16mem_a(opcode);
-                } else {
-                    return ld_a_r16mem(opcode);
-                }
-            case 0b011:
-                if (!y) {
-                    return inc_r16(opcode);
-                } else {
-                    return dec_r16(opcode);
-                }
-            case 0b100: return inc_r8(opcode);
-            case 0b101: return dec_r8(opcode);
-            case 0b110: return ld_r8_imm8(opcode);
+        std::memcpy(&header, buffer, sizeof(header));
+
+        if (header.magic != state_magic || header.version != state_version ||
+            header.size != size || size != get_state_size()) {
+            return std::unexpected(GameBoyError::invalid_state);
         }
 
-        return std::unexpected(GameBoyError::invalid_instruction);
-    }
+        StateReader state(buffer + sizeof(header));
+        state.get(af, bc, de, hl, sp, pc, halted);
+        sync.load_state(state);
+        bus.load_state(state);
+        invalidate_blocks(bus.take_code_writes());
 
-    std::expected<void, GameBoyError> CPU::block1(uint8_t opcode) {
-        if (opcode == 0x76) {
-            return halt(opcode);
-        }
+        fault.reset();
+        base_checkpoint.reset();
 
-        return ld_r8_r8(opcode);
+        return {};
     }
 
-    std::expected<void, GameBoyError> CPU::block2(uint8_t opcode) {
-        auto x = (opcode >> 3) & 0b111;
+    std::shared_ptr<const Checkpoint> CPU::checkpoint() {
+        auto checkpoint = std::make_shared<Checkpoint>();
+
+        checkpoint->parent = base_checkpoint;
+        checkpoint->core.resize(core_size);
+
+        StateWriter state(
+            checkpoint->core.data(), &checkpoint->pages, !base_checkpoint
+        );
+        save_body(state);
+
+        base_checkpoint = checkpoint;
+
+        return checkpoint;
+    }
 
-        switch (x) {
-            case 0b000: return add_a_r8(opcode);
-            case 0b001: return adc_a_r8(opcode);
-            case 0b010: return sub_a_r8(opcode);
-            case 0b011: return sbc_a_r8(opcode);
-            case 0b100: return and_a_r8(opcode);
-            case 0b101: return xor_a_r8(opcode);
-            case 0b110: return or_a_r8(opcode);
-            case 0b111: return cp_a_r8(opcode);
+    std::expected<void, GameBoyError> CPU::restore(
+        const std::shared_ptr<const Checkpoint> &checkpoint
+    ) {
+        if (checkpoint->core.size() != core_size) {
+            return std::unexpected(GameBoyError::invalid_state);
         }
 
-        std::unreachable();
-    }
-    
-    std::expected<void, GameBoyError> CPU::block3(uint8_t opcode) {
-        auto x = opcode & 0b111;
-
-        switch (opcode) {
-            case 0xc6: return add_a_imm8(opcode);
-            case 0xce: return adc_a_imm8(opcode);
-            case 0xd6: return sub_a_imm8(opcode);
-            case 0xde: return sbc_a_imm8(opcode);
-            case 0xe6: return and_a_imm8(opcode);
-            case 0xee: return xor_a_imm8(opcode);
-            case 0xf6: return or_a_imm8(opcode);
-            case 0xfe: return cp_a_imm8(opcode);
-            case 0xc9: return ret(opcode);
-            case 0xd9: return reti(opcode);
-            case 0xc3: return jp_imm16(opcode);
-            case 0xe9: return jp_hl(opcode);
-            case 0xcd: return call_imm16(opcode);
-            case 0xe2: return ldh_c_a(opcode);
-            case 0xe0: return ldh_imm8_a(opcode);
-            case 0xea: return ld_imm16_a(opcode);
-            case 0xf2: return ldh_a_c(opcode);
-            case 0xf0: return ldh_a_imm8(opcode);
-            case 0xfa: return ld_a_imm16(opcode);
-            case 0xe8: return add_sp_imm8(opcode);
-            case 0xf8: return ld_hl_sp_imm8(opcode);
-            case 0xf9: return ld_sp_hl(opcode);
-            case 0xf3: return di(opcode);
-            case 0xfb: return ei(opcode);
-            case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4: case 0xeb:
-            case 0xec: case 0xed: case 0xf4: case 0xfc: case 0xfd:
-                // TODO: implement CPU hard-lock
-                // TODO: verify if these checks are necessary
-                return std::unexpected(GameBoyError::unimplemented);
+        // The newest copy of each page wins
+        std::vector<const uint8_t *> sources(page_count);
+        size_t missing = page_count;
+
+        for (auto node = checkpoint.get(); node && missing;
+             node = node->parent.get()) {
+            auto &indexes = node->pages.indexes;
+
+            for (size_t i = 0; i < indexes.size(); i++) {
+                if (indexes[i] >= page_count) {
+                    return std::unexpected(GameBoyError::invalid_state);
+                }
+
+                auto &source = sources[indexes[i]];
+
+                if (!source) {
+                    source = node->pages.data.data() + i * state_page_size;
+                    missing--;
+                }
+            }
         }
-        
-        switch (x) {
-            case 0b000: return ret_cond(opcode);
-            case 0b010: return jp_cond_imm16(opcode);
-            case 0b100: return call_cond_imm16(opcode);
-            case 0b111: return rst_tgt3(opcode);
-            case 0b001: return pop_r16stk(opcode);
-            case 0b101: return push_r16stk(opcode);
+
+        if (missing) {
+            return std::unexpected(GameBoyError::invalid_state);
         }
 
-        return std::unexpected(GameBoyError::invalid_instruction);
-    }
+        StateReader state(checkpoint->core.data(), sources.data());
+        state.get(af, bc, de, hl, sp, pc, halted);
+        sync.load_state(state);
+        bus.load_state(state);
+        invalidate_blocks(bus.take_code_writes());
 
-    std::expected<void, GameBoyError> CPU::cb_prefix(uint8_t opcode) {
-        auto x = opcode >> 6;
-        auto y = (opcode >> 3) & 0b111;
+        fault.reset();
+        base_checkpoint = checkpoint;
 
-        switch (x) {
-            case 0b00:
-                switch (y) {
-                    case 0b000: return rlc_r8(opcode);
-                    case 0b001: return rrc_r8(opcode);
-                    case 0b010: return rl_r8(opcode);
-                    case 0b011: return rr_r8(opcode);
-                    case 0b100: return sla_r8(opcode);
-                    case 0b101: return sra_r8(opcode);
-                    case 0b110: return swap_r8(opcode);
-                    case 0b111: return srl_r8(opcode);
-                }
-                std::unreachable();
-            case 0b01: return bit_b3_r8(opcode);
-            case 0b10: return res_b3_r8(opcode);
-            case 0b11: return set_b3_r8(opcode);
+        return {};
+    }
+
+    /*
+     * The decoders below run only at compile time. They split the opcode into
+     * the same bit fields the hardware uses and pick the handler specialization
+     * for them, so no bit field is ever looked at while executing.
+     */
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::block0(void) {
+        constexpr auto x = opcode & 0b111;
+        constexpr bool y = (opcode >> 3) & 1;
+        constexpr auto r8 = static_cast<R8>((opcode >> 3) & 0b111);
+        constexpr auto r16 = static_cast<R16>((opcode >> 4) & 0b11);
+        constexpr auto r16mem = static_cast<R16Mem>((opcode >> 4) & 0b11);
+        constexpr auto cond = static_cast<Cond>((opcode >> 3) & 0b11);
+
+        if constexpr (opcode == 0x00) return &CPU::nop;
+        else if constexpr (opcode == 0x08) return &CPU::ld_imm16_sp;
+        else if constexpr (opcode == 0x07) return &CPU::rlca;
+        else if constexpr (opcode == 0x0f) return &CPU::rrca;
+        else if constexpr (opcode == 0x17) return &CPU::rla;
+        else if constexpr (opcode == 0x1f) return &CPU::rra;
+        else if constexpr (opcode == 0x27) return &CPU::daa;
+        else if constexpr (opcode == 0x2f) return &CPU::cpl;
+        else if constexpr (opcode == 0x37) return &CPU::scf;
+        else if constexpr (opcode == 0x3f) return &CPU::ccf;
+        else if constexpr (opcode == 0x18) return &CPU::jr_imm8;
+        else if constexpr (opcode == 0x10) return &CPU::stop;
+        else if constexpr (x == 0b000) return &CPU::jr_cond_imm8<cond>;
+        else if constexpr (x == 0b001 && !y) return &CPU::ld_r16_imm16<r16>;
+        else if constexpr (x == 0b001) return &CPU::add_hl_r16<r16>;
+        else if constexpr (x == 0b010 && !y) return &CPU::ld_r16mem_a<r16mem>;
+        else if constexpr (x == 0b010) return &CPU::ld_a_r16mem<r16mem>;
+        else if constexpr (x == 0b011 && !y) return &CPU::inc_r16<r16>;
+        else if constexpr (x == 0b011) return &CPU::dec_r16<r16>;
+        else if constexpr (x == 0b100) return &CPU::inc_r8<r8>;
+        else if constexpr (x == 0b101) return &CPU::dec_r8<r8>;
+        else return &CPU::ld_r8_imm8<r8>;
+    }
+
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::block1(void) {
+        constexpr auto source = static_cast<R8>(opcode & 0b111);
+        constexpr auto dest = static_cast<R8>((opcode >> 3) & 0b111);
+
+        if constexpr (opcode == 0x76) return &CPU::halt;
+        else return &CPU::ld_r8_r8<dest, source>;
+    }
+
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::block2(void) {
+        constexpr auto x = (opcode >> 3) & 0b111;
+        constexpr auto r8 = static_cast<R8>(opcode & 0b111);
+
+        if constexpr (x == 0b000) return &CPU::add_a_r8<r8>;
+        else if constexpr (x == 0b001) return &CPU::adc_a_r8<r8>;
+        else if constexpr (x == 0b010) return &CPU::sub_a_r8<r8>;
+        else if constexpr (x == 0b011) return &CPU::sbc_a_r8<r8>;
+        else if constexpr (x == 0b100) return &CPU::and_a_r8<r8>;
+        else if constexpr (x == 0b101) return &CPU::xor_a_r8<r8>;
+        else if constexpr (x == 0b110) return &CPU::or_a_r8<r8>;
+        else return &CPU::cp_a_r8<r8>;
+    }
+
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::block3(void) {
+        constexpr auto x = opcode & 0b111;
+        constexpr auto cond = static_cast<Cond>((opcode >> 3) & 0b11);
+        constexpr auto r16stk = static_cast<R16Stk>((opcode >> 4) & 0b11);
+        constexpr uint8_t tgt3 = (opcode >> 3) & 0b111;
+
+        if constexpr (opcode == 0xc6) return &CPU::add_a_imm8;
+        else if constexpr (opcode == 0xce) return &CPU::adc_a_imm8;
+        else if constexpr (opcode == 0xd6) return &CPU::sub_a_imm8;
+        else if constexpr (opcode == 0xde) return &CPU::sbc_a_imm8;
+        else if constexpr (opcode == 0xe6) return &CPU::and_a_imm8;
+        else if constexpr (opcode == 0xee) return &CPU::xor_a_imm8;
+        else if constexpr (opcode == 0xf6) return &CPU::or_a_imm8;
+        else if constexpr (opcode == 0xfe) return &CPU::cp_a_imm8;
+        else if constexpr (opcode == 0xc9) return &CPU::ret;
+        else if constexpr (opcode == 0xd9) return &CPU::reti;
+        else if constexpr (opcode == 0xc3) return &CPU::jp_imm16;
+        else if constexpr (opcode == 0xe9) return &CPU::jp_hl;
+        else if constexpr (opcode == 0xcd) return &CPU::call_imm16;
+        else if constexpr (opcode == 0xcb) return &CPU::cb_prefix;
+        else if constexpr (opcode == 0xe2) return &CPU::ldh_c_a;
+        else if constexpr (opcode == 0xe0) return &CPU::ldh_imm8_a;
+        else if constexpr (opcode == 0xea) return &CPU::ld_imm16_a;
+        else if constexpr (opcode == 0xf2) return &CPU::ldh_a_c;
+        else if constexpr (opcode == 0xf0) return &CPU::ldh_a_imm8;
+        else if constexpr (opcode == 0xfa) return &CPU::ld_a_imm16;
+        else if constexpr (opcode == 0xe8) return &CPU::add_sp_imm8;
+        else if constexpr (opcode == 0xf8) return &CPU::ld_hl_sp_imm8;
+        else if constexpr (opcode == 0xf9) return &CPU::ld_sp_hl;
+        else if constexpr (opcode == 0xf3) return &CPU::di;
+        else if constexpr (opcode == 0xfb) return &CPU::ei;
+        else if constexpr (x == 0b000 && opcode < 0xe0) return &CPU::ret_cond<cond>;
+        else if constexpr (x == 0b010 && opcode < 0xe0) return &CPU::jp_cond_imm16<cond>;
+        else if constexpr (x == 0b100 && opcode < 0xe0) return &CPU::call_cond_imm16<cond>;
+        else if constexpr (x == 0b111) return &CPU::rst_tgt3<tgt3>;
+        else if constexpr (x == 0b001) return &CPU::pop_r16stk<r16stk>;
+        else if constexpr (x == 0b101 && !((opcode >> 3) & 1)) {
+            return &CPU::push_r16stk<r16stk>;
         }
+        // 0xd3, 0xdb, 0xdd, 0xe3, 0xe4, 0xeb, 0xec, 0xed, 0xf4, 0xfc, 0xfd
+        else return &CPU::hard_lock;
+    }
+
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::decode(void) {
+        constexpr auto block = opcode >> 6;
+
+        if constexpr (block == 0) return block0<opcode>();
+        else if constexpr (block == 1) return block1<opcode>();
+        else if constexpr (block == 2) return block2<opcode>();
+        else return block3<opcode>();
+    }
+
+    template <uint8_t opcode>
+    constexpr CPU::Handler CPU::decode_cb(void) {
+        constexpr auto x = opcode >> 6;
+        constexpr uint8_t y = (opcode >> 3) & 0b111;
+        constexpr auto r8 = static_cast<R8>(opcode & 0b111);
+
+        if constexpr (x == 0b01) return &CPU::bit_b3_r8<y, r8>;
+        else if constexpr (x == 0b10) return &CPU::res_b3_r8<y, r8>;
+        else if constexpr (x == 0b11) return &CPU::set_b3_r8<y, r8>;
+        else if constexpr (y == 0b000) return &CPU::rlc_r8<r8>;
+        else if constexpr (y == 0b001) return &CPU::rrc_r8<r8>;
+        else if constexpr (y == 0b010) return &CPU::rl_r8<r8>;
+        else if constexpr (y == 0b011) return &CPU::rr_r8<r8>;
+        else if constexpr (y == 0b100) return &CPU::sla_r8<r8>;
+        else if constexpr (y == 0b101) return &CPU::sra_r8<r8>;
+        else if constexpr (y == 0b110) return &CPU::swap_r8<r8>;
+        else return &CPU::srl_r8<r8>;
+    }
+
+    template <size_t... opcodes>
+    constexpr std::array<CPU::Handler, 256> CPU::make_op_table(
+        std::index_sequence<opcodes...>
+    ) {
+        return { decode<static_cast<uint8_t>(opcodes)>()... };
+    }
 
-        std::unreachable();
+    template <size_t... opcodes>
+    constexpr std::array<CPU::Handler, 256> CPU::make_cb_table(
+        std::index_sequence<opcodes...>
+    ) {
+        return { decode_cb<static_cast<uint8_t>(opcodes)>()... };
     }
+
+    constinit const std::array<CPU::Handler, 256> CPU::op_table =
+        make_op_table(std::make_index_sequence<256>());
+
+    constinit const std::array<CPU::Handler, 256> CPU::cb_table =
+        make_cb_table(std::make_index_sequence<256>());
 }
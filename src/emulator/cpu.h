@@ -1,13 +1,23 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <expected>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
 #include "defs.h"
 #include "bus.h"
+#include "checkpoint.h"
+#include "state.h"
+#include "sync.h"
 
 namespace emulator {
     class CPU {
         private:
+            using Handler = void (CPU::*)(void);
+
             union RegisterPair af;
             union RegisterPair bc;
             union RegisterPair de;
@@ -15,11 +25,68 @@ namespace emulator {
             uint16_t sp;
             uint16_t pc;
 
-            bool ime;
+            // Stopped by HALT until an interrupt is pending
+            bool halted;
+
+            std::optional<GameBoyError> fault;
+
+#ifdef GUB_PROFILE
+            // Opcode being profiled, 0x100 | opcode after a CB prefix
+            uint16_t profiled_opcode;
+#endif
 
+            Synchronizer sync;
             Bus bus;
+            // Owned by the bus, which maps IF and IE
+            io::Interrupts &interrupts;
+
+            /*
+             * Dirty pages are relative to this checkpoint, the last one taken
+             * or restored. Null until the first checkpoint, or after a full
+             * load_state, so the next checkpoint starts a new chain.
+             */
+            std::shared_ptr<const Checkpoint> base_checkpoint;
+            size_t core_size;
+            size_t page_count;
+
+            /*
+             * Block cache. A block is a straight run of instructions in ROM
+             * or WRAM, up to the first control transfer or page boundary,
+             * decoded once into the handlers to call. Blocks are keyed by the
+             * host address of their first instruction, which also tells ROM
+             * banks apart, and live in a direct-mapped table where a
+             * colliding block simply replaces the previous one.
+             */
+            struct MicroOp {
+                Handler handler;
+                // Opcode bytes the handler expects to be already fetched
+                uint8_t opcode_length;
+                uint8_t cycles;
+            };
 
-            bool cb_flag;
+            struct Block {
+                const uint8_t *key;
+                uint8_t count;
+                // Cycles per iteration when the block is a polling loop
+                uint16_t loop_cycles;
+                std::array<MicroOp, 16> ops;
+            };
+
+            static constexpr size_t block_cache_size = 512;
+            // WRAM pages rewritten this many times are no longer cached
+            static constexpr uint8_t max_code_rewrites = 8;
+
+            std::unique_ptr<std::array<Block, block_cache_size>> blocks;
+            std::array<uint8_t, 2 * Bus::wram_bank_size / 0x100> code_rewrites;
+            uint32_t uncached_code;
+
+            /*
+             * Both tables are built at compile time from the opcode bit
+             * fields, so every entry points to a handler already specialized
+             * on its operands.
+             */
+            static const std::array<Handler, 256> op_table;
+            static const std::array<Handler, 256> cb_table;
 
             inline uint8_t get_a(void);
             inline uint8_t get_f(void);
@@ -44,118 +111,265 @@ namespace emulator {
             inline bool get_flag_h(void);
             inline bool get_flag_c(void);
 
-            void set_flag_z(bool value);
-            void set_flag_n(bool value);
-            void set_flag_h(bool value);
-            void set_flag_c(bool value);
+            inline void set_flag_z(bool value);
+            inline void set_flag_n(bool value);
+            inline void set_flag_h(bool value);
+            inline void set_flag_c(bool value);
 
-            std::expected<uint8_t, GameBoyError> get_r8(uint8_t r8);
-            std::expected<void, GameBoyError> set_r8(
-                uint8_t r8, uint8_t value
-            );
+            template <R8 r8> inline uint8_t get_r8(void);
+            template <R8 r8> inline void set_r8(uint8_t value);
 
-            std::expected<uint16_t, GameBoyError> get_r16(uint8_t r16);
-            std::expected<void, GameBoyError> set_r16(
-                uint8_t r16, uint16_t value
-            );
-            
-            std::expected<uint16_t, GameBoyError> get_r16stk(uint8_t r16stk);
-            std::expected<void, GameBoyError> set_r16stk(
-                uint8_t r16stk, uint16_t value
+            template <R16 r16> inline uint16_t get_r16(void);
+            template <R16 r16> inline void set_r16(uint16_t value);
+
+            template <R16Stk r16stk> inline uint16_t get_r16stk(void);
+            template <R16Stk r16stk> inline void set_r16stk(uint16_t value);
+
+            template <R16Mem r16mem> inline uint16_t get_r16mem(void);
+
+            template <Cond cond> inline bool get_cond(void);
+
+            inline uint8_t fetch_byte(void);
+            inline uint16_t fetch_word(void);
+
+            inline uint16_t load_word(uint16_t address);
+            inline void store_word(uint16_t address, uint16_t value);
+
+            inline void push_word(uint16_t value);
+            inline uint16_t pop_word(void);
+
+            inline void alu_add(uint8_t value, bool carry);
+            inline void alu_sub(uint8_t value, bool carry);
+            inline void alu_and(uint8_t value);
+            inline void alu_xor(uint8_t value);
+            inline void alu_or(uint8_t value);
+            inline void alu_cp(uint8_t value);
+
+            void nop(void);
+            template <R16 dest>
+            void ld_r16_imm16(void);
+            template <R16Mem dest>
+            void ld_r16mem_a(void);
+            template <R16Mem source>
+            void ld_a_r16mem(void);
+            void ld_imm16_sp(void);
+            template <R16 operand>
+            void inc_r16(void);
+            template <R16 operand>
+            void dec_r16(void);
+            template <R16 operand>
+            void add_hl_r16(void);
+            template <R8 operand>
+            void inc_r8(void);
+            template <R8 operand>
+            void dec_r8(void);
+            template <R8 dest>
+            void ld_r8_imm8(void);
+            void rlca(void);
+            void rrca(void);
+            void rla(void);
+            void rra(void);
+            void daa(void);
+            void cpl(void);
+            void scf(void);
+            void ccf(void);
+            void jr_imm8(void);
+            template <Cond cond>
+            void jr_cond_imm8(void);
+            void stop(void);
+            template <R8 dest, R8 source>
+            void ld_r8_r8(void);
+            void halt(void);
+            template <R8 operand>
+            void add_a_r8(void);
+            template <R8 operand>
+            void adc_a_r8(void);
+            template <R8 operand>
+            void sub_a_r8(void);
+            template <R8 operand>
+            void sbc_a_r8(void);
+            template <R8 operand>
+            void and_a_r8(void);
+            template <R8 operand>
+            void xor_a_r8(void);
+            template <R8 operand>
+            void or_a_r8(void);
+            template <R8 operand>
+            void cp_a_r8(void);
+            void add_a_imm8(void);
+            void adc_a_imm8(void);
+            void sub_a_imm8(void);
+            void sbc_a_imm8(void);
+            void and_a_imm8(void);
+            void xor_a_imm8(void);
+            void or_a_imm8(void);
+            void cp_a_imm8(void);
+            template <Cond cond>
+            void ret_cond(void);
+            void ret(void);
+            void reti(void);
+            template <Cond cond>
+            void jp_cond_imm16(void);
+            void jp_imm16(void);
+            void jp_hl(void);
+            template <Cond cond>
+            void call_cond_imm16(void);
+            void call_imm16(void);
+            template <uint8_t tgt3>
+            void rst_tgt3(void);
+            template <R16Stk reg>
+            void pop_r16stk(void);
+            template <R16Stk reg>
+            void push_r16stk(void);
+            void ldh_c_a(void);
+            void ldh_imm8_a(void);
+            void ld_imm16_a(void);
+            void ldh_a_c(void);
+            void ldh_a_imm8(void);
+            void ld_a_imm16(void);
+            void add_sp_imm8(void);
+            void ld_hl_sp_imm8(void);
+            void ld_sp_hl(void);
+            void di(void);
+            void ei(void);
+            void hard_lock(void);
+            template <R8 operand>
+            void rlc_r8(void);
+            template <R8 operand>
+            void rrc_r8(void);
+            template <R8 operand>
+            void rl_r8(void);
+            template <R8 operand>
+            void rr_r8(void);
+            template <R8 operand>
+            void sla_r8(void);
+            template <R8 operand>
+            void sra_r8(void);
+            template <R8 operand>
+            void swap_r8(void);
+            template <R8 operand>
+            void srl_r8(void);
+            template <uint8_t bit3, R8 operand>
+            void bit_b3_r8(void);
+            template <uint8_t bit3, R8 operand>
+            void res_b3_r8(void);
+            template <uint8_t bit3, R8 operand>
+            void set_b3_r8(void);
+
+            void cb_prefix(void);
+
+            void raise(GameBoyError error);
+
+            template <uint8_t opcode> static constexpr Handler block0(void);
+            template <uint8_t opcode> static constexpr Handler block1(void);
+            template <uint8_t opcode> static constexpr Handler block2(void);
+            template <uint8_t opcode> static constexpr Handler block3(void);
+            template <uint8_t opcode> static constexpr Handler decode(void);
+            template <uint8_t opcode> static constexpr Handler decode_cb(void);
+
+            template <size_t... opcodes>
+            static constexpr std::array<Handler, 256> make_op_table(
+                std::index_sequence<opcodes...>
             );
-            
-            std::expected<uint16_t, GameBoyError> get_r16mem(uint8_t r16mem);
-            std::expected<void, GameBoyError> set_r16mem(
-                uint8_t r16mem, uint16_t value
+            template <size_t... opcodes>
+            static constexpr std::array<Handler, 256> make_cb_table(
+                std::index_sequence<opcodes...>
             );
 
-            std::expected<bool, GameBoyError> get_cond(uint8_t cond);
+            inline void decode_execute(uint8_t opcode);
 
-            std::expected<uint16_t, GameBoyError> load_word(uint16_t address);
-            std::expected<void, GameBoyError> store_word(
-                uint16_t address, uint16_t value
-            );
+            inline bool execute_block(void);
+            bool build_block(Block &block, const uint8_t *key);
+            void invalidate_blocks(uint32_t pages);
+            void handle_code_writes(void);
+
+            bool handle_interrupts(void);
+            void idle_until_event(void);
+            void wake(void);
+#ifdef GUB_PROFILE
+            void execute_profiled(void);
+#endif
 
-            std::expected<void, GameBoyError> ld_r16_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_r16mem_a(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_a_r16mem(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_imm16_sp(uint8_t opcode);
-            std::expected<void, GameBoyError> inc_r16(uint8_t opcode);
-            std::expected<void, GameBoyError> dec_r16(uint8_t opcode);
-            std::expected<void, GameBoyError> add_hl_r16(uint8_t opcode);
-            std::expected<void, GameBoyError> inc_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> dec_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_r8_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> rlca(uint8_t opcode);
-            std::expected<void, GameBoyError> rrca(uint8_t opcode);
-            std::expected<void, GameBoyError> rla(uint8_t opcode);
-            std::expected<void, GameBoyError> rra(uint8_t opcode);
-            std::expected<void, GameBoyError> daa(uint8_t opcode);
-            std::expected<void, GameBoyError> cpl(uint8_t opcode);
-            std::expected<void, GameBoyError> scf(uint8_t opcode);
-            std::expected<void, GameBoyError> ccf(uint8_t opcode);
-            std::expected<void, GameBoyError> jr_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> jr_cond_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> stop(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_r8_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> halt(uint8_t opcode);
-            std::expected<void, GameBoyError> add_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> adc_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> sub_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> sbc_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> and_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> xor_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> or_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> cp_a_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> add_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> adc_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> sub_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> sbc_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> and_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> xor_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> or_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> cp_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> ret_cond(uint8_t opcode);
-            std::expected<void, GameBoyError> ret(uint8_t opcode);
-            std::expected<void, GameBoyError> reti(uint8_t opcode);
-            std::expected<void, GameBoyError> jp_cond_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> jp_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> jp_hl(uint8_t opcode);
-            std::expected<void, GameBoyError> call_cond_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> call_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> rst_tgt3(uint8_t opcode);
-            std::expected<void, GameBoyError> pop_r16stk(uint8_t opcode);
-            std::expected<void, GameBoyError> push_r16stk(uint8_t opcode);
-            std::expected<void, GameBoyError> ldh_c_a(uint8_t opcode);
-            std::expected<void, GameBoyError> ldh_imm8_a(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_imm16_a(uint8_t opcode);
-            std::expected<void, GameBoyError> ldh_a_c(uint8_t opcode);
-            std::expected<void, GameBoyError> ldh_a_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_a_imm16(uint8_t opcode);
-            std::expected<void, GameBoyError> add_sp_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_hl_sp_imm8(uint8_t opcode);
-            std::expected<void, GameBoyError> ld_sp_hl(uint8_t opcode);
-            std::expected<void, GameBoyError> di(uint8_t opcode);
-            std::expected<void, GameBoyError> ei(uint8_t opcode);
-            std::expected<void, GameBoyError> rlc_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> rrc_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> rl_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> rr_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> sla_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> sra_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> swap_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> srl_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> bit_b3_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> res_b3_r8(uint8_t opcode);
-            std::expected<void, GameBoyError> set_b3_r8(uint8_t opcode);
-
-            std::expected<void, GameBoyError> decode_execute(uint8_t opcode);
-            std::expected<void, GameBoyError> block0(uint8_t opcode);
-            std::expected<void, GameBoyError> block1(uint8_t opcode);
-            std::expected<void, GameBoyError> block2(uint8_t opcode);
-            std::expected<void, GameBoyError> block3(uint8_t opcode);
-            std::expected<void, GameBoyError> cb_prefix(uint8_t opcode);
+            void save_body(StateWriter &state) const;
 
         public:
+            CPU(Cartridge &cartridge, const ExternalMemory &memory = {});
+
+            std::expected<void, GameBoyError> step(void);
+            std::expected<void, GameBoyError> run(uint64_t cycles);
+
+            /*
+             * In CGB mode the framebuffer holds indexes into the palette
+             * RAM instead of shades: 0-31 for the background palettes,
+             * 32-63 for the object ones. The palettes are 128 bytes of
+             * little endian RGB555 colors, 4 per palette; changes made in
+             * the middle of a frame aren't captured.
+             */
+            const uint8_t *get_framebuffer() const;
+            bool is_cgb() const;
+            const uint8_t *get_palettes() const;
+            uint64_t get_frame_count() const;
+            const std::string &get_serial_output() const;
+
+            // A set bit means pressed, see the masks in io::Joypad
+            void set_buttons(uint8_t pressed);
+
+            /*
+             * Audio comes out as interleaved stereo 16-bit frames at the
+             * sample rate (48 kHz by default). The ring may be drained from
+             * another thread while the CPU runs.
+             */
+            void set_sample_rate(uint32_t rate);
+            SampleRing &get_samples();
+
+            /*
+             * Headless modes. With video disabled the framebuffer is left as
+             * is, and with audio disabled no samples are produced, but both
+             * keep every register, their timing and their interrupts exact.
+             * Both are on by default and aren't part of save states.
+             */
+            void set_video_enabled(bool enabled);
+            void set_audio_enabled(bool enabled);
+
+            /*
+             * OAM DMA always copies all 160 bytes at once. In accurate mode
+             * the CPU is also cut off from everything but IO registers and
+             * HRAM for the 160 M-cycles the transfer takes, as on hardware;
+             * off by default, letting code that races the transfer run.
+             */
+            void set_accurate_oam_dma(bool enabled);
+
+            // T-cycles emulated since power on
+            uint64_t get_cycles() const;
+
+            // Reads through the bus as the CPU would
+            uint8_t peek(uint16_t address);
+
+#ifdef GUB_PROFILE
+            Profiler &get_profiler();
+#endif
+
+            /*
+             * Save states cover the whole machine, cartridge RAM included.
+             * save_state writes exactly get_state_size() bytes, which stays
+             * the same for the lifetime of the CPU, so one buffer can be
+             * reused for every snapshot. Restoring clears any fault.
+             */
+            size_t get_state_size() const;
+            void save_state(uint8_t *buffer) const;
+            std::expected<void, GameBoyError> load_state(
+                const uint8_t *buffer, size_t size
+            );
+
+            /*
+             * Incremental snapshots: checkpoint stores only the pages written
+             * since the last checkpoint taken or restored, which becomes its
+             * parent. Restoring works from any checkpoint taken on a CPU
+             * running the same cartridge.
+             */
+            std::shared_ptr<const Checkpoint> checkpoint();
+            std::expected<void, GameBoyError> restore(
+                const std::shared_ptr<const Checkpoint> &checkpoint
+            );
     };
 }
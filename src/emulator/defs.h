@@ -13,13 +13,32 @@ namespace emulator {
 
     enum class GameBoyError {
         invalid_address,
+        invalid_cartridge,
         invalid_cond,
         invalid_flag,
         invalid_instruction,
         invalid_register,
+        invalid_state,
+        io_error,
         unimplemented
     };
 
+    constexpr const char *to_string(GameBoyError error) {
+        switch (error) {
+            case GameBoyError::invalid_address: return "invalid_address";
+            case GameBoyError::invalid_cartridge: return "invalid_cartridge";
+            case GameBoyError::invalid_cond: return "invalid_cond";
+            case GameBoyError::invalid_flag: return "invalid_flag";
+            case GameBoyError::invalid_instruction: return "invalid_instruction";
+            case GameBoyError::invalid_register: return "invalid_register";
+            case GameBoyError::invalid_state: return "invalid_state";
+            case GameBoyError::io_error: return "io_error";
+            case GameBoyError::unimplemented: return "unimplemented";
+        }
+
+        return "unknown";
+    }
+
     enum class Flags: uint8_t {
         c = 4,
         h = 5,
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+namespace emulator {
+    /*
+     * Host memory an instance can be given instead of allocating its own,
+     * so that many instances keep the same buffer side by side in one
+     * contiguous array. Provided buffers must start zeroed and outlive the
+     * instance; null members are allocated by the instance.
+     */
+    struct ExternalMemory {
+        // Bus::wram_size bytes, all eight CGB banks
+        uint8_t *wram = nullptr;
+        // PPU::width * PPU::height bytes
+        uint8_t *framebuffer = nullptr;
+    };
+}
@@ -1,13 +1,610 @@
 #include <cstdint>
+#include <utility>
 
 #include "audio.h"
 
 namespace emulator::io {
+    namespace {
+        // Waveforms of the square channels, one bit per duty step
+        constexpr uint8_t duty_patterns[4] = { 0x01, 0x81, 0x87, 0x7e };
+
+        // Bits that always read back as 1, for 0xff10-0xff26
+        constexpr uint8_t read_masks[0x17] = {
+            0x80, 0x3f, 0x00, 0xff, 0xbf, // NR10-NR14
+            0xff, 0x3f, 0x00, 0xff, 0xbf, // NR21-NR24
+            0x7f, 0xff, 0x9f, 0xff, 0xbf, // NR30-NR34
+            0xff, 0xff, 0x00, 0x00, 0xbf, // NR41-NR44
+            0x00, 0x00, 0x70              // NR50-NR52
+        };
+
+        constexpr size_t wave = 2;
+        constexpr size_t noise = 3;
+
+        constexpr uint16_t get_frequency(uint8_t nrx3, uint8_t nrx4) {
+            return (nrx4 & 0x07) << 8 | nrx3;
+        }
+    }
+
+    // Register state left behind by the DMG boot ROM, beep included
+    Audio::Audio(Synchronizer &sync, const Timer &timer)
+        : sync(sync), timer(timer), nr52(0x80), nr51(0xf3), nr50(0x77),
+          channels{}, sweep{}, lfsr(0), wave_pattern_ram{}, sequencer_step(0),
+          sequencer_time(0), output_enabled(true),
+          sample_rate(default_sample_rate),
+          buffers{
+              StepBuffer(default_sample_rate), StepBuffer(default_sample_rate)
+          },
+          levels{} {
+        constexpr uint8_t registers[4][5] = {
+            { 0x80, 0xbf, 0xf3, 0xff, 0xbf },
+            { 0x00, 0x3f, 0x00, 0xff, 0xbf },
+            { 0x7f, 0xff, 0x9f, 0xff, 0xbf },
+            { 0x00, 0xff, 0x00, 0x00, 0xbf },
+        };
+
+        for (size_t i = 0; i < channels.size(); i++) {
+            auto &channel = channels[i];
+
+            channel.nrx0 = registers[i][0];
+            channel.nrx1 = registers[i][1];
+            channel.nrx2 = registers[i][2];
+            channel.nrx3 = registers[i][3];
+            channel.nrx4 = registers[i][4];
+        }
+
+        channels[0].enabled = true;
+
+        power_on();
+    }
+
+    uint64_t Audio::get_period(size_t index) const {
+        auto &channel = channels[index];
+
+        if (index == noise) {
+            uint64_t divisor = channel.nrx3 & 0x07;
+
+            return (divisor ? divisor * 16 : 8) << (channel.nrx3 >> 4);
+        }
+
+        uint64_t period = 2048 - get_frequency(channel.nrx3, channel.nrx4);
+
+        return index == wave ? period * 2 : period * 4;
+    }
+
+    bool Audio::dac_enabled(size_t index) const {
+        return index == wave
+            ? channels[wave].nrx0 & 0x80
+            : channels[index].nrx2 & 0xf8;
+    }
+
+    // Recomputes the digital output from the channel's current step
+    void Audio::refresh(size_t index) {
+        auto &channel = channels[index];
+
+        switch (index) {
+            case wave: {
+                auto byte = wave_pattern_ram[channel.position >> 1];
+                uint8_t sample = channel.position & 1 ? byte & 0x0f : byte >> 4;
+                uint8_t code = (channel.nrx2 >> 5) & 0x03;
+
+                channel.output = code ? sample >> (code - 1) : 0;
+                break;
+            }
+            case noise:
+                channel.output = lfsr & 1 ? 0 : channel.volume;
+                break;
+            default: {
+                auto pattern = duty_patterns[channel.nrx1 >> 6];
+
+                channel.output = (pattern >> channel.position) & 1
+                    ? channel.volume
+                    : 0;
+                break;
+            }
+        }
+    }
+
+    void Audio::clock_edge(size_t index) {
+        auto &channel = channels[index];
+
+        switch (index) {
+            case wave:
+                channel.position = (channel.position + 1) & 31;
+                break;
+            case noise: {
+                uint16_t bit = (lfsr ^ (lfsr >> 1)) & 1;
+
+                lfsr = (lfsr >> 1) | bit << 14;
+
+                // 7-bit mode also feeds bit 6
+                if (channel.nrx3 & 0x08) {
+                    lfsr = (lfsr & ~0x40) | bit << 6;
+                }
+                break;
+            }
+            default:
+                channel.position = (channel.position + 1) & 7;
+                break;
+        }
+
+        refresh(index);
+    }
+
+    /*
+     * Walks every frequency timer expiration up to until. This is the only
+     * place channels advance, and it only runs when something is about to
+     * change what they play.
+     */
+    void Audio::render(uint64_t until) {
+        for (size_t index = 0; index < channels.size(); index++) {
+            auto &channel = channels[index];
+
+            if (!channel.enabled) {
+                continue;
+            }
+
+            auto period = get_period(index);
+
+            if (channel.next_edge > until) {
+                continue;
+            }
+
+            /*
+             * A muted channel (or any channel, with output disabled) has no
+             * level changes to add. Square and wave channels then just move
+             * their position ahead; the noise channel can't skip, as its
+             * LFSR has to go through every step.
+             */
+            bool muted = !output_enabled || (
+                index == wave
+                    ? !(channel.nrx2 & 0x60)
+                    : !channel.volume
+            );
+
+            if (muted && index != noise) {
+                auto edges = (until - channel.next_edge) / period + 1;
+
+                channel.position =
+                    (channel.position + edges) & (index == wave ? 31 : 7);
+                channel.next_edge += edges * period;
+                refresh(index);
+                continue;
+            }
+
+            while (channel.next_edge <= until) {
+                clock_edge(index);
+
+                if (!muted) {
+                    update_output(index, channel.next_edge);
+                }
+
+                channel.next_edge += period;
+            }
+        }
+    }
+
+    /*
+     * Brings what the channel contributes to each side, through its DAC,
+     * NR51 panning and NR50 volume, up to date, as of time.
+     */
+    void Audio::update_output(size_t index, uint64_t time) {
+        if (!output_enabled) {
+            return;
+        }
+
+        auto &channel = channels[index];
+        int32_t analog = channel.enabled && dac_enabled(index)
+            ? channel.output * 2 - 15
+            : 0;
+
+        for (size_t side = 0; side < buffers.size(); side++) {
+            // Left is the high nibble of both NR50 and NR51
+            int shift = side ? 0 : 4;
+            bool routed = nr51 & (1 << (index + shift));
+            int32_t volume = ((nr50 >> shift) & 0x07) + 1;
+            int32_t level = routed ? analog * volume * amplitude : 0;
+
+            if (level != levels[index][side]) {
+                buffers[side].add_delta(time, level - levels[index][side]);
+                levels[index][side] = level;
+            }
+        }
+    }
+
+    void Audio::update_outputs(uint64_t time) {
+        for (size_t index = 0; index < channels.size(); index++) {
+            update_output(index, time);
+        }
+    }
+
+    /*
+     * Starts the output over, taking the current levels as the baseline so
+     * that restarting doesn't step from silence to them with a click.
+     */
+    void Audio::reset_output(uint64_t time) {
+        levels = {};
+        update_outputs(time);
+
+        for (auto &buffer : buffers) {
+            buffer.reset(sample_rate, time);
+        }
+    }
+
+    // Moves every finished sample before time into the ring
+    void Audio::flush(uint64_t time) {
+        std::array<int16_t, StepBuffer::capacity * 2> frames;
+
+        for (auto &buffer : buffers) {
+            buffer.end_frame(time);
+        }
+
+        auto count = buffers[0].read(frames.data(), StepBuffer::capacity, 2);
+        buffers[1].read(frames.data() + 1, count, 2);
+
+        samples.push(frames.data(), count);
+    }
+
+    uint16_t Audio::compute_sweep() {
+        auto &nr10 = channels[0].nrx0;
+        uint16_t delta = sweep.shadow >> (nr10 & 0x07);
+
+        return nr10 & 0x08 ? sweep.shadow - delta : sweep.shadow + delta;
+    }
+
+    void Audio::clock_length(size_t index) {
+        auto &channel = channels[index];
+
+        if ((channel.nrx4 & 0x40) && channel.length && !--channel.length) {
+            channel.enabled = false;
+        }
+    }
+
+    void Audio::clock_envelope(size_t index) {
+        auto &channel = channels[index];
+        uint8_t period = channel.nrx2 & 0x07;
+
+        if (!period) {
+            return;
+        }
+
+        if (channel.envelope_timer > 1) {
+            channel.envelope_timer--;
+            return;
+        }
+
+        channel.envelope_timer = period;
+
+        if ((channel.nrx2 & 0x08) && channel.volume < 15) {
+            channel.volume++;
+        } else if (!(channel.nrx2 & 0x08) && channel.volume > 0) {
+            channel.volume--;
+        }
+
+        refresh(index);
+    }
+
+    void Audio::clock_sweep() {
+        auto &channel = channels[0];
+        uint8_t period = (channel.nrx0 >> 4) & 0x07;
+
+        if (sweep.timer > 1) {
+            sweep.timer--;
+            return;
+        }
+
+        sweep.timer = period ? period : 8;
+
+        if (!sweep.enabled || !period) {
+            return;
+        }
+
+        auto frequency = compute_sweep();
+
+        if (frequency > 2047) {
+            channel.enabled = false;
+        } else if (channel.nrx0 & 0x07) {
+            sweep.shadow = frequency;
+            channel.nrx3 = frequency & 0xff;
+            channel.nrx4 = (channel.nrx4 & ~0x07) | frequency >> 8;
+
+            // The new frequency is checked again, but not applied
+            if (compute_sweep() > 2047) {
+                channel.enabled = false;
+            }
+        }
+    }
+
+    void Audio::trigger(size_t index) {
+        auto &channel = channels[index];
+
+        channel.enabled = dac_enabled(index);
+
+        if (!channel.length) {
+            channel.length = index == wave ? 256 : 64;
+        }
+
+        channel.next_edge = sync.get_now() + get_period(index);
+        channel.volume = channel.nrx2 >> 4;
+        channel.envelope_timer = channel.nrx2 & 0x07;
+
+        if (index == wave) {
+            channel.position = 0;
+        } else if (index == noise) {
+            lfsr = 0x7fff;
+        } else if (index == 0) {
+            uint8_t period = (channel.nrx0 >> 4) & 0x07;
+            uint8_t shift = channel.nrx0 & 0x07;
+
+            sweep.shadow = get_frequency(channel.nrx3, channel.nrx4);
+            sweep.timer = period ? period : 8;
+            sweep.enabled = period || shift;
+
+            if (shift && compute_sweep() > 2047) {
+                channel.enabled = false;
+            }
+        }
+
+        refresh(index);
+    }
+
+    /*
+     * The frame sequencer restarts from its first step, which comes with
+     * the next falling edge of bit 12 of the system counter.
+     */
+    void Audio::power_on() {
+        nr52 |= 0x80;
+        sequencer_step = 0;
+        sequencer_time = next_sequencer_edge();
+        sync.set_next_event(Synchronizer::Module::audio, sequencer_time);
+        reset_output(sync.get_now());
+    }
+
+    /*
+     * The frame sequencer steps on falling edges of bit 12 of the system
+     * counter, or bit 13 in double speed mode, which keeps the same rate.
+     */
+    uint64_t Audio::next_sequencer_edge() const {
+        auto shift = sync.get_speed_shift();
+        auto period = sequencer_period << shift;
+
+        return sync.get_now() +
+            ((period - timer.get_counter() % period) >> shift);
+    }
+
+    // Clears every register but the wave pattern RAM
+    void Audio::power_off() {
+        nr52 = 0;
+        nr51 = 0;
+        nr50 = 0;
+        channels = {};
+        sweep = {};
+        lfsr = 0;
+        sync.set_next_event(Synchronizer::Module::audio, Synchronizer::never);
+        update_outputs(sync.get_now());
+    }
+
+    void Audio::on_event() {
+        render(sequencer_time);
+
+        // Length on even steps, sweep on 2 and 6, envelope on 7
+        if (!(sequencer_step & 1)) {
+            for (size_t index = 0; index < channels.size(); index++) {
+                clock_length(index);
+            }
+        }
+
+        if (sequencer_step == 2 || sequencer_step == 6) {
+            clock_sweep();
+        }
+
+        if (sequencer_step == 7) {
+            clock_envelope(0);
+            clock_envelope(1);
+            clock_envelope(noise);
+        }
+
+        if (output_enabled) {
+            update_outputs(sequencer_time);
+            flush(sequencer_time);
+        }
+
+        sequencer_step = (sequencer_step + 1) & 7;
+        sequencer_time += sequencer_period;
+        sync.set_next_event(Synchronizer::Module::audio, sequencer_time);
+    }
+
+    void Audio::reset_sequencer(bool falling_edge) {
+        if (!(nr52 & 0x80)) {
+            return;
+        }
+
+        // on_event schedules the next step itself
+        sequencer_time = sync.get_now();
+
+        if (falling_edge) {
+            on_event();
+        } else {
+            sequencer_time += sequencer_period;
+            sync.set_next_event(Synchronizer::Module::audio, sequencer_time);
+        }
+    }
+
+    void Audio::set_sample_rate(uint32_t rate) {
+        sample_rate = rate;
+        reset_output(sync.get_now());
+    }
+
+    void Audio::set_output_enabled(bool enabled) {
+        if (enabled && !output_enabled) {
+            output_enabled = true;
+            reset_output(sync.get_now());
+        }
+
+        output_enabled = enabled;
+    }
+
+    SampleRing &Audio::get_samples() {
+        return samples;
+    }
+
+    void Audio::write_channel(size_t index, uint8_t reg, uint8_t value) {
+        auto &channel = channels[index];
+
+        switch (reg) {
+            case 0:
+                // Only the first square and the wave channel have NRx0
+                if (index == 0 || index == wave) {
+                    channel.nrx0 = value;
+                }
+                break;
+            case 1:
+                channel.nrx1 = value;
+                channel.length = index == wave
+                    ? 256 - value
+                    : 64 - (value & 0x3f);
+                break;
+            case 2:
+                channel.nrx2 = value;
+                break;
+            case 3:
+                channel.nrx3 = value;
+                break;
+            case 4:
+                channel.nrx4 = value;
+
+                if (value & 0x80) {
+                    trigger(index);
+                }
+                break;
+        }
+
+        if (!dac_enabled(index)) {
+            channel.enabled = false;
+        }
+
+        refresh(index);
+    }
+
+    /*
+     * This method presents undefined behavior when address is invalid and thus
+     * should only be used by the bus.
+     */
     uint8_t Audio::read(const uint16_t address) const {
-        TODO();
+        if (address >= 0x20) {
+            return wave_pattern_ram[address - 0x20];
+        }
+
+        switch (address) {
+            case 0x14: return nr50;
+            case 0x15: return nr51;
+            case 0x16: {
+                uint8_t status = nr52 | read_masks[address];
+
+                for (size_t index = 0; index < channels.size(); index++) {
+                    status |= channels[index].enabled << index;
+                }
+
+                return status;
+            }
+        }
+
+        auto &channel = channels[address / 5];
+        uint8_t value = 0;
+
+        switch (address % 5) {
+            case 0: value = channel.nrx0; break;
+            case 1: value = channel.nrx1; break;
+            case 2: value = channel.nrx2; break;
+            case 3: value = channel.nrx3; break;
+            case 4: value = channel.nrx4; break;
+        }
+
+        return value | read_masks[address];
     }
 
     void Audio::write(const uint16_t address, const uint8_t value) {
-        TODO();
+        auto now = sync.get_now();
+        bool powered = nr52 & 0x80;
+
+        // Everything before the write plays with the old values
+        if (powered) {
+            render(now);
+        }
+
+        if (address >= 0x20) {
+            wave_pattern_ram[address - 0x20] = value;
+            return;
+        }
+
+        if (address == 0x16) {
+            if (powered && !(value & 0x80)) {
+                power_off();
+            } else if (!powered && (value & 0x80)) {
+                power_on();
+            }
+            return;
+        }
+
+        // Only NR52 and the wave pattern RAM are writable while powered off
+        if (!powered) {
+            return;
+        }
+
+        switch (address) {
+            case 0x14:
+                nr50 = value;
+                update_outputs(now);
+                break;
+            case 0x15:
+                nr51 = value;
+                update_outputs(now);
+                break;
+            default:
+                write_channel(address / 5, address % 5, value);
+                update_output(address / 5, now);
+                break;
+        }
+    }
+
+    /*
+     * The pending frame sequencer event lives in the synchronizer state.
+     * Buffered output isn't saved: loading starts it over from silence.
+     */
+    void Audio::save_state(StateWriter &state) const {
+        state.put(nr52, nr51, nr50);
+
+        for (auto &channel : channels) {
+            state.put(
+                channel.nrx0, channel.nrx1, channel.nrx2, channel.nrx3,
+                channel.nrx4, channel.enabled, channel.length,
+                channel.position, channel.volume, channel.envelope_timer,
+                channel.output, channel.next_edge
+            );
+        }
+
+        state.put(
+            sweep.enabled, sweep.timer, sweep.shadow, lfsr, wave_pattern_ram,
+            sequencer_step, sequencer_time
+        );
+    }
+
+    void Audio::load_state(StateReader &state) {
+        state.get(nr52, nr51, nr50);
+
+        for (auto &channel : channels) {
+            state.get(
+                channel.nrx0, channel.nrx1, channel.nrx2, channel.nrx3,
+                channel.nrx4, channel.enabled, channel.length,
+                channel.position, channel.volume, channel.envelope_timer,
+                channel.output, channel.next_edge
+            );
+        }
+
+        state.get(
+            sweep.enabled, sweep.timer, sweep.shadow, lfsr, wave_pattern_ram,
+            sequencer_step, sequencer_time
+        );
+
+        reset_output(sync.get_now());
     }
 }
@@ -3,33 +3,145 @@
 #include <array>
 #include <cstdint>
 
+#include "../sample_ring.h"
+#include "../state.h"
+#include "../step_buffer.h"
+#include "../sync.h"
+#include "timer.h"
+
 namespace emulator::io {
+    /*
+     * APU: two square channels (the first with a frequency sweep), the wave
+     * channel and the noise channel.
+     *
+     * Nothing runs per cycle. Each channel knows when its frequency timer
+     * next expires, and the channels are only rendered up to the current
+     * time when a register is written or the frame sequencer (length,
+     * sweep and envelope, on every falling edge of bit 12 of the system
+     * counter, bit 13 in double speed) fires, walking the timer expirations
+     * in between. Level changes go to band-limited step buffers at the
+     * output rate, and every frame sequencer step moves the finished
+     * samples into a ring buffer for the host to drain. While the APU is
+     * powered off no event is scheduled and nothing is rendered.
+     */
     class Audio {
+        public:
+            static constexpr uint32_t default_sample_rate = 48000;
+
         private:
+            static constexpr uint64_t sequencer_period = 8192;
+            // Output level of one channel at full volume, per step
+            static constexpr int32_t amplitude = 32;
+
+            // Channel registers NRx0-NRx4 and the state they drive
             struct Channel {
-                uint8_t nrx1; 
-                uint8_t nrx2; 
-                uint8_t nrx3; 
+                uint8_t nrx0;
+                uint8_t nrx1;
+                uint8_t nrx2;
+                uint8_t nrx3;
                 uint8_t nrx4;
+
+                bool enabled;
+                uint16_t length;
+                // Duty step, wave sample index
+                uint8_t position;
+                // Envelope volume; unused by the wave channel
+                uint8_t volume;
+                uint8_t envelope_timer;
+                // Digital output, 0-15
+                uint8_t output;
+                // When the frequency timer next expires
+                uint64_t next_edge;
             };
 
-            struct FeaturedChannel : Channel {
-                uint8_t nrx0;
+            struct Sweep {
+                bool enabled;
+                uint8_t timer;
+                uint16_t shadow;
             };
 
+            Synchronizer &sync;
+            const Timer &timer;
+
             uint8_t nr52;
             uint8_t nr51;
             uint8_t nr50;
 
-            FeaturedChannel c1;
-            Channel c2;
-            FeaturedChannel c3;
-            Channel c4;
+            std::array<Channel, 4> channels;
+            Sweep sweep;
+            uint16_t lfsr;
+
+            std::array<uint8_t, 0x10> wave_pattern_ram;
+
+            uint8_t sequencer_step;
+            uint64_t sequencer_time;
+
+            /*
+             * Output side, not part of the machine state. levels holds what
+             * each channel currently contributes to each side, as last added
+             * to the step buffers.
+             */
+            bool output_enabled;
+            uint32_t sample_rate;
+            std::array<StepBuffer, 2> buffers;
+            std::array<std::array<int32_t, 2>, 4> levels;
+            SampleRing samples;
 
-            std::array<uint8_t, 0xf> wave_pattern_ram;
+            uint64_t get_period(size_t index) const;
+            bool dac_enabled(size_t index) const;
+
+            void refresh(size_t index);
+            void clock_edge(size_t index);
+            void render(uint64_t until);
+            void update_output(size_t index, uint64_t time);
+            void update_outputs(uint64_t time);
+            void reset_output(uint64_t time);
+            void flush(uint64_t time);
+
+            uint16_t compute_sweep();
+            void clock_length(size_t index);
+            void clock_envelope(size_t index);
+            void clock_sweep();
+
+            uint64_t next_sequencer_edge() const;
+
+            void trigger(size_t index);
+            void power_on();
+            void power_off();
+
+            void write_channel(size_t index, uint8_t reg, uint8_t value);
 
         public:
-            
+            Audio(Synchronizer &sync, const Timer &timer);
+
+            void on_event();
+            /*
+             * Realigns the frame sequencer after DIV was written, which
+             * clocks it when the counter bit driving it was set.
+             */
+            void reset_sequencer(bool falling_edge);
+
+            /*
+             * Samples are produced at sample_rate as interleaved stereo
+             * frames, and dropped while the ring is full.
+             */
+            void set_sample_rate(uint32_t rate);
+
+            /*
+             * Without output, channels still advance and the frame sequencer
+             * still runs, so NR52 and every register read back the same, but
+             * no samples are synthesized.
+             */
+            void set_output_enabled(bool enabled);
+            SampleRing &get_samples();
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
+            /*
+             * Addresses are relative to 0xff10: 0x00-0x16 are the channel
+             * and control registers, 0x20-0x2f the wave pattern RAM.
+             */
             uint8_t read(const uint16_t address) const;
             void write(const uint16_t address, const uint8_t value);
     };
@@ -3,13 +3,75 @@
 #include "interrupts.h"
 
 namespace emulator::io {
-    Interrupts::Interrupts() : if_(0xe0) { }
+    Interrupts::Interrupts()
+        : if_(0xe0), ie(0), ime(false), enabling(false) {
+        update();
+    }
+
+    void Interrupts::update() {
+        pending = if_ & ie & 0x1f;
+        ready = enabling || (ime && pending);
+    }
+
+    void Interrupts::request(const uint8_t mask) {
+        if_ |= mask & 0x1f;
+        update();
+    }
+
+    void Interrupts::enable() {
+        enabling = !ime;
+        update();
+    }
+
+    void Interrupts::enable_now() {
+        ime = true;
+        enabling = false;
+        update();
+    }
+
+    void Interrupts::disable() {
+        ime = false;
+        enabling = false;
+        update();
+    }
+
+    void Interrupts::finish_enable() {
+        ime = ime || enabling;
+        enabling = false;
+        update();
+    }
+
+    void Interrupts::acknowledge(const uint8_t mask) {
+        if_ &= ~mask;
+        ime = false;
+        enabling = false;
+        update();
+    }
 
     uint8_t Interrupts::read() const {
         return if_;
     }
 
     void Interrupts::write(const uint8_t value) {
-        if_ |= value & 0x1f;
+        if_ = 0xe0 | value;
+        update();
+    }
+
+    uint8_t Interrupts::read_enable() const {
+        return ie;
+    }
+
+    void Interrupts::write_enable(const uint8_t value) {
+        ie = value;
+        update();
+    }
+
+    void Interrupts::save_state(StateWriter &state) const {
+        state.put(if_, ie, ime, enabling);
+    }
+
+    void Interrupts::load_state(StateReader &state) {
+        state.get(if_, ie, ime, enabling);
+        update();
     }
 }
@@ -2,15 +2,75 @@
 
 #include <cstdint>
 
+#include "../state.h"
+
 namespace emulator::io {
+    /*
+     * Interrupt controller: IF, IE and the CPU's master enable, IME,
+     * including the one instruction delay of EI.
+     *
+     * Sources request interrupts far less often than the CPU executes
+     * instructions, so what the CPU needs to know is worked out whenever
+     * one of them changes: pending holds the interrupts both requested and
+     * enabled, which wake the CPU from HALT, and ready is set while there is
+     * something to do at the next instruction boundary, that is dispatching
+     * an interrupt or letting an EI take effect. Every instruction then only
+     * tests ready.
+     */
     class Interrupts {
         private:
             uint8_t if_;
+            uint8_t ie;
+            bool ime;
+            // EI executed, IME is set after the next instruction
+            bool enabling;
+
+            uint8_t pending;
+            bool ready;
+
+            void update();
 
         public:
+            static constexpr uint8_t vblank = 1 << 0;
+            static constexpr uint8_t stat = 1 << 1;
+            static constexpr uint8_t timer = 1 << 2;
+            static constexpr uint8_t serial = 1 << 3;
+            static constexpr uint8_t joypad = 1 << 4;
+
             Interrupts();
 
+            void request(const uint8_t mask);
+
+            inline uint8_t get_pending() const { return pending; }
+            inline bool is_ready() const { return ready; }
+            inline bool get_ime() const { return ime; }
+
+            // EI; takes effect after the next instruction
+            void enable();
+            // RETI; takes effect right away
+            void enable_now();
+            // DI, which also cancels an EI still waiting to take effect
+            void disable();
+
+            /*
+             * Called at the boundary ready stopped at when nothing was
+             * dispatched, lets a delayed EI take effect.
+             */
+            void finish_enable();
+
+            /*
+             * Dispatch: clears the request in mask, which may be empty, and
+             * IME.
+             */
+            void acknowledge(const uint8_t mask);
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
             uint8_t read() const;
             void write(const uint8_t value);
+
+            uint8_t read_enable() const;
+            void write_enable(const uint8_t value);
     };
 }
@@ -2,13 +2,31 @@
 #include <cstdint>
 
 namespace emulator::io {
+    Joypad::Joypad(Interrupts &interrupts)
+        : interrupts(interrupts), controls(0xff), joyp(0xcf) { }
+
+    /*
+     * Both groups can be selected at once, in which case a line reads low if
+     * a button from either group is pressed. The interrupt fires when a line
+     * goes low.
+     */
     void Joypad::update() {
         auto selection = (joyp & 0x30) >> 4;
 
         uint8_t buttons_state = selection & 0b10 ? 0xf : controls & 0xf;
         uint8_t dpad_state = selection & 0b01 ? 0xf : controls >> 4;
+        uint8_t lines = buttons_state & dpad_state;
+
+        if (joyp & ~lines & 0xf) {
+            interrupts.request(Interrupts::joypad);
+        }
 
-        joyp = (joyp & 0xf0) | buttons_state | dpad_state;
+        joyp = (joyp & 0xf0) | lines;
+    }
+
+    void Joypad::set_buttons(const uint8_t pressed) {
+        controls = ~pressed;
+        update();
     }
 
     const uint8_t Joypad::read() const {
@@ -19,4 +37,12 @@ namespace emulator::io {
         joyp = (joyp & 0xcf) | (value & 0x30);
         update();
     }
+
+    void Joypad::save_state(StateWriter &state) const {
+        state.put(controls, joyp);
+    }
+
+    void Joypad::load_state(StateReader &state) {
+        state.get(controls, joyp);
+    }
 }
@@ -2,14 +2,38 @@
 
 #include <cstdint>
 
+#include "../state.h"
+#include "interrupts.h"
+
 namespace emulator::io {
     class Joypad {
         private:
+            Interrupts &interrupts;
+
+            // Active low, buttons in the low nibble and the d-pad above
             uint8_t controls;
             uint8_t joyp;
 
             void update();
         public:
+            // Masks for set_buttons
+            static constexpr uint8_t a = 1 << 0;
+            static constexpr uint8_t b = 1 << 1;
+            static constexpr uint8_t select = 1 << 2;
+            static constexpr uint8_t start = 1 << 3;
+            static constexpr uint8_t right = 1 << 4;
+            static constexpr uint8_t left = 1 << 5;
+            static constexpr uint8_t up = 1 << 6;
+            static constexpr uint8_t down = 1 << 7;
+
+            Joypad(Interrupts &interrupts);
+
+            // Sets every button at once; a set bit means pressed
+            void set_buttons(const uint8_t pressed);
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
             const uint8_t read() const;
             void write(const uint8_t value);
     };
@@ -1,13 +1,223 @@
 #include <cstdint>
+#include <utility>
 
 #include "lcd.h"
 
 namespace emulator::io {
+    namespace {
+        constexpr uint64_t oam_scan_cycles = 80;
+        constexpr uint64_t drawing_cycles = 172;
+        constexpr uint64_t hblank_cycles = 204;
+        constexpr uint64_t line_cycles = 456;
+        constexpr uint8_t visible_lines = 144;
+        constexpr uint8_t total_lines = 154;
+
+        // BCPS and OCPS move to the next byte on writes when bit 7 is set
+        constexpr uint8_t increment_index(uint8_t index) {
+            return index & 0x80 ? 0x80 | ((index + 1) & 0x3f) : index;
+        }
+    }
+
+    // Register state left behind by the DMG boot ROM, with the LCD running
+    LCD::LCD(
+        Synchronizer &sync, Interrupts &interrupts, const uint8_t *vram,
+        const uint8_t *oam, TileCache &tiles, uint8_t *framebuffer, bool cgb
+    ) : sync(sync), interrupts(interrupts),
+        ppu(vram, oam, tiles, framebuffer, cgb), lcdc(0x91),
+        stat(0), scy(0), scx(0), ly(0), lyc(0), bgp(0xfc), obp0(0xff),
+        obp1(0xff), wy(0), wx(0), bcps(0), ocps(0),
+        mode(Mode::oam_scan), stat_line(false),
+        rendering(true), frame_count(0), mode_end(sync.get_now()) {
+        // Every color white
+        palettes.fill(0xff);
+        enter_mode(Mode::oam_scan, oam_scan_cycles);
+    }
+
+    /*
+     * Modes only change on scheduled events, so LY and STAT are always exact
+     * when read in between. Durations are counted from the scheduled end of
+     * the previous mode rather than from when the event was serviced, so
+     * servicing latency never accumulates into drift.
+     */
+    void LCD::enter_mode(Mode next, uint64_t duration) {
+        mode = next;
+        mode_end += duration;
+        sync.set_next_event(Synchronizer::Module::lcd, mode_end);
+        update_stat_line();
+    }
+
+    // The STAT interrupt fires on rising edges of the OR of its sources
+    void LCD::update_stat_line() {
+        bool line = ((stat & 0x40) && ly == lyc) ||
+            ((stat & 0x08) && mode == Mode::hblank) ||
+            ((stat & 0x10) && mode == Mode::vblank) ||
+            ((stat & 0x20) && mode == Mode::oam_scan);
+
+        if (line && !stat_line) {
+            interrupts.request(Interrupts::stat);
+        }
+
+        stat_line = line;
+    }
+
+    void LCD::on_event() {
+        switch (mode) {
+            case Mode::oam_scan:
+                enter_mode(Mode::drawing, drawing_cycles);
+                break;
+            case Mode::drawing: {
+                PPU::Registers registers{
+                    lcdc, scy, scx, bgp, obp0, obp1, wy, wx
+                };
+
+                if (rendering) {
+                    ppu.render_line(registers, ly);
+                } else {
+                    ppu.skip_line(registers, ly);
+                }
+
+                enter_mode(Mode::hblank, hblank_cycles);
+                break;
+            }
+            case Mode::hblank:
+                ly++;
+
+                if (ly == visible_lines) {
+                    frame_count++;
+                    interrupts.request(Interrupts::vblank);
+                    enter_mode(Mode::vblank, line_cycles);
+                } else {
+                    enter_mode(Mode::oam_scan, oam_scan_cycles);
+                }
+                break;
+            case Mode::vblank:
+                ly++;
+
+                if (ly == total_lines) {
+                    ly = 0;
+                    ppu.start_frame();
+                    enter_mode(Mode::oam_scan, oam_scan_cycles);
+                } else {
+                    enter_mode(Mode::vblank, line_cycles);
+                }
+                break;
+        }
+    }
+
+    void LCD::set_rendering(bool enabled) {
+        rendering = enabled;
+    }
+
+    const uint8_t *LCD::get_framebuffer() const {
+        return ppu.get_framebuffer();
+    }
+
+    uint64_t LCD::get_frame_count() const {
+        return frame_count;
+    }
+
+    const uint8_t *LCD::get_palettes() const {
+        return palettes.data();
+    }
+
+    bool LCD::in_hblank() const {
+        return mode == Mode::hblank;
+    }
+
+    /*
+     * This method presents undefined behavior when address is invalid and thus
+     * should only be used by the bus.
+     */
     uint8_t LCD::read(const uint16_t address) const {
-        TODO();
+        switch (address) {
+            case 0x0: return lcdc;
+            case 0x1:
+                return 0x80 | (stat & 0x78) | ((ly == lyc) << 2) |
+                    std::to_underlying(mode);
+            case 0x2: return scy;
+            case 0x3: return scx;
+            case 0x4: return ly;
+            case 0x5: return lyc;
+            case 0x7: return bgp;
+            case 0x8: return obp0;
+            case 0x9: return obp1;
+            case 0xa: return wy;
+            case 0xb: return wx;
+            case 0x28: return bcps | 0x40;
+            case 0x29: return palettes[bcps & 0x3f];
+            case 0x2a: return ocps | 0x40;
+            case 0x2b: return palettes[0x40 | (ocps & 0x3f)];
+        }
+
+        std::unreachable();
     }
 
     void LCD::write(const uint16_t address, const uint8_t value) {
-        TODO();
+        switch (address) {
+            case 0x0: {
+                bool was_on = lcdc & 0x80;
+                lcdc = value;
+
+                if (was_on && !(value & 0x80)) {
+                    ly = 0;
+                    mode = Mode::hblank;
+                    sync.set_next_event(
+                        Synchronizer::Module::lcd, Synchronizer::never
+                    );
+                    update_stat_line();
+                } else if (!was_on && (value & 0x80)) {
+                    ppu.start_frame();
+                    mode_end = sync.get_now();
+                    enter_mode(Mode::oam_scan, oam_scan_cycles);
+                }
+                break;
+            }
+            case 0x1:
+                stat = value & 0x78;
+                update_stat_line();
+                break;
+            case 0x2: scy = value; break;
+            case 0x3: scx = value; break;
+            case 0x4: break;
+            case 0x5:
+                lyc = value;
+                update_stat_line();
+                break;
+            case 0x7: bgp = value; break;
+            case 0x8: obp0 = value; break;
+            case 0x9: obp1 = value; break;
+            case 0xa: wy = value; break;
+            case 0xb: wx = value; break;
+            case 0x28: bcps = value & 0xbf; break;
+            case 0x29:
+                palettes[bcps & 0x3f] = value;
+                bcps = increment_index(bcps);
+                break;
+            case 0x2a: ocps = value & 0xbf; break;
+            case 0x2b:
+                palettes[0x40 | (ocps & 0x3f)] = value;
+                ocps = increment_index(ocps);
+                break;
+        }
+    }
+
+    /*
+     * The pending LCD event lives in the synchronizer state, so only the
+     * registers and the mode bookkeeping are saved here.
+     */
+    void LCD::save_state(StateWriter &state) const {
+        state.put(
+            lcdc, stat, scy, scx, ly, lyc, bgp, obp0, obp1, wy, wx, palettes,
+            bcps, ocps, mode, stat_line, frame_count, mode_end
+        );
+        ppu.save_state(state);
+    }
+
+    void LCD::load_state(StateReader &state) {
+        state.get(
+            lcdc, stat, scy, scx, ly, lyc, bgp, obp0, obp1, wy, wx, palettes,
+            bcps, ocps, mode, stat_line, frame_count, mode_end
+        );
+        ppu.load_state(state);
     }
 }
@@ -1,10 +1,28 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 
+#include "../ppu.h"
+#include "../state.h"
+#include "../sync.h"
+#include "../tile_cache.h"
+#include "interrupts.h"
+
 namespace emulator::io {
     class LCD {
         private:
+            enum class Mode: uint8_t {
+                hblank = 0,
+                vblank = 1,
+                oam_scan = 2,
+                drawing = 3
+            };
+
+            Synchronizer &sync;
+            Interrupts &interrupts;
+            PPU ppu;
+
             uint8_t lcdc; 
             uint8_t stat;
             uint8_t scy;
@@ -14,8 +32,54 @@ namespace emulator::io {
             uint8_t bgp;
             uint8_t obp0;
             uint8_t obp1;
+            uint8_t wy;
+            uint8_t wx;
+
+            /*
+             * CGB palette RAM, eight background then eight sprite palettes
+             * of four little-endian RGB555 colors, and the BCPS and OCPS
+             * indexes into each half
+             */
+            std::array<uint8_t, 128> palettes;
+            uint8_t bcps;
+            uint8_t ocps;
+
+            Mode mode;
+            bool stat_line;
+            // Host setting, not machine state
+            bool rendering;
+            uint64_t frame_count;
+
+            // When the current mode was scheduled to end
+            uint64_t mode_end;
+
+            void enter_mode(Mode next, uint64_t duration);
+            void update_stat_line();
         
         public:
+            LCD(
+                Synchronizer &sync, Interrupts &interrupts, const uint8_t *vram,
+                const uint8_t *oam, TileCache &tiles, uint8_t *framebuffer,
+                bool cgb
+            );
+
+            void on_event();
+
+            /*
+             * Without rendering, lines are never drawn but modes, LY, STAT
+             * and their interrupts keep their exact timing.
+             */
+            void set_rendering(bool enabled);
+
+            const uint8_t *get_framebuffer() const;
+            uint64_t get_frame_count() const;
+            const uint8_t *get_palettes() const;
+
+            // Also true while the LCD is off
+            bool in_hblank() const;
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
 
             uint8_t read(const uint16_t address) const;
             void write (const uint16_t address, const uint8_t value);
@@ -0,0 +1,47 @@
+#include <utility>
+
+#include "serial.h"
+
+namespace emulator::io {
+    Serial::Serial(Interrupts &interrupts)
+        : interrupts(interrupts), sb(0), sc(0x7e) { }
+
+    const std::string &Serial::get_output() const {
+        return output;
+    }
+
+    uint8_t Serial::read(const uint8_t address) const {
+        switch (address) {
+            case 0: return sb;
+            case 1: return sc | 0x7e;
+        }
+
+        std::unreachable();
+    }
+
+    void Serial::write(const uint8_t address, const uint8_t value) {
+        if (address == 0) {
+            sb = value;
+            return;
+        }
+
+        sc = value;
+
+        // Transfer requested with the internal clock
+        if ((sc & 0x81) == 0x81) {
+            output.push_back(static_cast<char>(sb));
+            sb = 0xff;
+            sc &= 0x7f;
+            interrupts.request(Interrupts::serial);
+        }
+    }
+
+    // The output log belongs to the host and survives restores
+    void Serial::save_state(StateWriter &state) const {
+        state.put(sb, sc);
+    }
+
+    void Serial::load_state(StateReader &state) {
+        state.get(sb, sc);
+    }
+}
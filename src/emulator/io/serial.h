@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "../state.h"
+#include "interrupts.h"
+
+namespace emulator::io {
+    /*
+     * Serial port with nothing plugged in. Transfers clocked by the Game Boy
+     * complete immediately and shift in 0xff; every byte sent is kept, since
+     * test ROMs report their results over the link cable.
+     */
+    class Serial {
+        private:
+            Interrupts &interrupts;
+
+            uint8_t sb;
+            uint8_t sc;
+
+            std::string output;
+
+        public:
+            Serial(Interrupts &interrupts);
+
+            const std::string &get_output() const;
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
+            uint8_t read(const uint8_t address) const;
+            void write(const uint8_t address, const uint8_t value);
+    };
+}
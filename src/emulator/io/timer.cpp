@@ -1,16 +1,156 @@
+#include <utility>
+
 #include "timer.h"
 
 namespace emulator::io {
+    namespace {
+        // Counter cycles between TIMA increments, by TAC clock select
+        constexpr uint64_t periods[4] = { 1024, 16, 64, 256 };
+        // Delay from an overflow to the TMA reload and interrupt
+        constexpr uint64_t reload_delay = 4;
+    }
+
+    // Register state left behind by the DMG boot ROM
+    Timer::Timer(Synchronizer &sync, Interrupts &interrupts)
+        : sync(sync), interrupts(interrupts),
+          counter_offset(0xabcc - sync.get_cpu_time()), tima(0), tma(0),
+          tac(0xf8), last_update(sync.get_cpu_time()),
+          reload_time(Synchronizer::never) { }
+
+    uint64_t Timer::get_period() const {
+        return periods[tac & 0x03];
+    }
+
+    // The selected counter bit ANDed with the enable bit, as of now
+    bool Timer::get_signal() const {
+        return (tac & 0x04) && (get_counter() & (get_period() / 2));
+    }
+
+    // Whether TIMA overflowed and is waiting to be reloaded
+    bool Timer::reloading() const {
+        return reload_time != Synchronizer::never &&
+            reload_time - reload_delay <= sync.get_cpu_time();
+    }
+
+    /*
+     * Counts the falling edges since the last update. Every overflow is
+     * handled by its event before time can reach the next one, so TIMA
+     * wraps at most once here, to the 0 it holds until the reload.
+     */
+    void Timer::update(uint64_t time) {
+        if (tac & 0x04) {
+            auto period = get_period();
+
+            tima += get_ticks(time) / period - get_ticks(last_update) / period;
+        }
+
+        last_update = time;
+    }
+
+    // A falling edge caused by a register write rather than the clock
+    void Timer::increment() {
+        if (++tima == 0) {
+            reload_time = sync.get_cpu_time() + reload_delay;
+            sync.set_next_event(
+                Synchronizer::Module::timer, sync.to_time(reload_time)
+            );
+        }
+    }
+
+    /*
+     * Finds when the counter will have gone through enough falling edges
+     * to overflow TIMA, which must be up to date.
+     */
+    void Timer::schedule() {
+        if (tac & 0x04) {
+            auto period = get_period();
+            auto ticks = get_ticks(sync.get_cpu_time());
+            auto overflow = (ticks / period + 256 - tima) * period;
+
+            reload_time = overflow - counter_offset + reload_delay;
+        } else {
+            reload_time = Synchronizer::never;
+        }
+
+        sync.set_next_event(
+            Synchronizer::Module::timer, sync.to_time(reload_time)
+        );
+    }
+
+    uint16_t Timer::get_counter() const {
+        return get_ticks(sync.get_cpu_time());
+    }
+
+    void Timer::on_event() {
+        update(reload_time);
+        tima = tma;
+        interrupts.request(Interrupts::timer);
+        update(sync.get_cpu_time());
+        schedule();
+    }
+
     /*
      * This method presents undefined behavior when address is invalid and thus
      * should only be used by the bus.
      */
-    const uint8_t Timer::read(uint8_t address) const {
+    uint8_t Timer::read(uint8_t address) {
         switch (address) {
-            case 0: return div;
-            case 1: return tima;
+            case 0: return get_counter() >> 8;
+            case 1:
+                update(sync.get_cpu_time());
+                return tima;
             case 2: return tma;
             case 3: return tac;
         }
+
+        std::unreachable();
+    }
+
+    void Timer::write(const uint8_t address, const uint8_t value) {
+        update(sync.get_cpu_time());
+
+        switch (address) {
+            case 0: {
+                bool signal = get_signal();
+
+                counter_offset = -sync.get_cpu_time();
+                last_update = sync.get_cpu_time();
+
+                if (signal) {
+                    increment();
+                }
+                break;
+            }
+            case 1:
+                // Cancels a pending reload, along with its interrupt
+                tima = value;
+                reload_time = Synchronizer::never;
+                break;
+            case 2:
+                tma = value;
+                return;
+            case 3: {
+                bool signal = get_signal();
+
+                tac = value | 0xf8;
+
+                if (signal && !get_signal()) {
+                    increment();
+                }
+                break;
+            }
+        }
+
+        if (!reloading()) {
+            schedule();
+        }
+    }
+
+    void Timer::save_state(StateWriter &state) const {
+        state.put(counter_offset, tima, tma, tac, last_update, reload_time);
+    }
+
+    void Timer::load_state(StateReader &state) {
+        state.get(counter_offset, tima, tma, tac, last_update, reload_time);
     }
 }
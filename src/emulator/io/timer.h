@@ -2,19 +2,69 @@
 
 #include <cstdint>
 
+#include "../state.h"
+#include "../sync.h"
+#include "interrupts.h"
+
 namespace emulator::io {
+    /*
+     * DIV and TIMA, both derived from the 16-bit system counter, which goes
+     * up by one every CPU T-cycle, so twice as fast in double speed mode,
+     * and all times here are CPU times. DIV is its upper byte, and TIMA
+     * goes up on every falling edge of the counter bit TAC selects (while
+     * TAC enables it), so neither is ever stepped: the counter is computed
+     * from the clock, TIMA catches up on the edges elapsed when it's
+     * accessed, and its next overflow is scheduled as an event.
+     *
+     * Overflow leaves TIMA at 0 for one M-cycle before it's reloaded from
+     * TMA and the interrupt is requested; writing TIMA in that window
+     * cancels both. Writes to DIV and TAC that pull the selected bit low
+     * count as a falling edge, as on hardware.
+     */
     class Timer {
         private:
-            uint8_t div;
+            Synchronizer &sync;
+            Interrupts &interrupts;
+
+            /*
+             * The system counter is the low 16 bits of the CPU time plus
+             * counter_offset
+             */
+            uint64_t counter_offset;
+
             uint8_t tima;
             uint8_t tma;
             uint8_t tac;
 
+            // When tima was last brought up to date
+            uint64_t last_update;
+            // When the pending overflow reloads TIMA, or never
+            uint64_t reload_time;
+
+            inline uint64_t get_ticks(uint64_t time) const {
+                return time + counter_offset;
+            }
+
+            uint64_t get_period() const;
+            bool get_signal() const;
+            bool reloading() const;
+
+            void update(uint64_t time);
+            void increment();
+            void schedule();
+
         public:
-            void start_div();
-            void stop_div();
-            
-            uint8_t read(uint8_t address) const;
+            Timer(Synchronizer &sync, Interrupts &interrupts);
+
+            uint16_t get_counter() const;
+
+            void on_event();
+
+            // The pending overflow lives in the synchronizer state
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
+            uint8_t read(uint8_t address);
             void write(const uint8_t address, const uint8_t value);
     };
 }
@@ -1,47 +1,240 @@
+#include <utility>
+
 #include "io_dispatcher.h"
 
 namespace emulator {
-    uint8_t IoDispatcher::read(const uint16_t address) {
-        if (address == 0) {
-            return joypad.read();
-        } else if (address >= 0x04 && address <= 0x07) {
-            return timer.read(address - 0x04);
-        }else if (address == 0x0f) {
-            return interrupts.read();
-        } else if (address >= 0x10 && address <= 0x26) {
-            return audio.read(address - 0x10);
-        } else if (address >= 0x30 && address <= 0x3f) {
-            return audio.read(address - 0x30);
-        } else if (address == 0x46) {
-            return oam_dma_transfer; 
-        } else if (address <= 0x4b) {
-            return lcd.read(address - 0x40);
-        } else if (address == 0x50) {
-            return boot_rom_mapping_control;
+    const std::array<IoDispatcher::Register, 0x80> IoDispatcher::registers =
+        IoDispatcher::make_registers();
+
+    std::array<IoDispatcher::Register, 0x80> IoDispatcher::make_registers() {
+        std::array<Register, 0x80> result;
+
+        auto route = [&](size_t first, size_t last, Reader read, Writer write) {
+            for (size_t address = first; address <= last; address++) {
+                result[address] = Register{ read, write };
+            }
+        };
+
+        route(
+            0x00, 0x7f, &IoDispatcher::read_unmapped,
+            &IoDispatcher::write_unmapped
+        );
+        route(
+            0x00, 0x00, &IoDispatcher::read_joypad, &IoDispatcher::write_joypad
+        );
+        route(
+            0x01, 0x02, &IoDispatcher::read_serial, &IoDispatcher::write_serial
+        );
+        route(
+            0x04, 0x07, &IoDispatcher::read_timer, &IoDispatcher::write_timer
+        );
+        route(
+            0x0f, 0x0f, &IoDispatcher::read_interrupts,
+            &IoDispatcher::write_interrupts
+        );
+        route(
+            0x10, 0x26, &IoDispatcher::read_audio, &IoDispatcher::write_audio
+        );
+        route(
+            0x30, 0x3f, &IoDispatcher::read_audio, &IoDispatcher::write_audio
+        );
+        route(0x40, 0x4b, &IoDispatcher::read_lcd, &IoDispatcher::write_lcd);
+        route(
+            0x46, 0x46, &IoDispatcher::read_oam_dma,
+            &IoDispatcher::write_oam_dma
+        );
+        route(
+            0x50, 0x50, &IoDispatcher::read_boot_rom,
+            &IoDispatcher::write_boot_rom
+        );
+        route(
+            0x68, 0x6b, &IoDispatcher::read_palettes,
+            &IoDispatcher::write_palettes
+        );
+
+        return result;
+    }
+
+    IoDispatcher::IoDispatcher(
+        Synchronizer &sync, const uint8_t *vram, const uint8_t *oam,
+        TileCache &tiles, uint8_t *framebuffer, bool cgb
+    ) : sync(sync), cgb(cgb), joypad(interrupts), timer(sync, interrupts),
+        serial(interrupts), audio(sync, timer),
+        lcd(sync, interrupts, vram, oam, tiles, framebuffer, cgb),
+        oam_dma_transfer(0xff), boot_rom_mapping_control(0xff) { }
+
+    void IoDispatcher::handle_event(Synchronizer::Module module) {
+        using Module = Synchronizer::Module;
+
+        switch (module) {
+            case Module::timer:
+                timer.on_event();
+                break;
+            case Module::lcd:
+                lcd.on_event();
+                break;
+            case Module::audio:
+                audio.on_event();
+                break;
+            default:
+                std::unreachable();
         }
-        
-        TODO("empty region");
+    }
+
+    const uint8_t *IoDispatcher::get_framebuffer() const {
+        return lcd.get_framebuffer();
+    }
+
+    uint64_t IoDispatcher::get_frame_count() const {
+        return lcd.get_frame_count();
+    }
+
+    const uint8_t *IoDispatcher::get_palettes() const {
+        return lcd.get_palettes();
+    }
+
+    bool IoDispatcher::in_hblank() const {
+        return lcd.in_hblank();
+    }
+
+    const std::string &IoDispatcher::get_serial_output() const {
+        return serial.get_output();
+    }
+
+    void IoDispatcher::set_buttons(const uint8_t pressed) {
+        joypad.set_buttons(pressed);
+    }
+
+    void IoDispatcher::set_sample_rate(uint32_t rate) {
+        audio.set_sample_rate(rate);
+    }
+
+    SampleRing &IoDispatcher::get_samples() {
+        return audio.get_samples();
+    }
+
+    void IoDispatcher::set_video_enabled(bool enabled) {
+        lcd.set_rendering(enabled);
+    }
+
+    void IoDispatcher::set_audio_enabled(bool enabled) {
+        audio.set_output_enabled(enabled);
+    }
+
+    uint8_t IoDispatcher::read(const uint16_t address) {
+        return (this->*registers[address].read)(address);
     }
 
     void IoDispatcher::write(const uint16_t address, const uint8_t value) {
-        if (address == 0) {
-            joypad.write(value);
-        } else if (address >= 0x04 && address <= 0x07) {
-            timer.write(address - 0x04, value);
-        }else if (address == 0x0f) {
-            interrupts.write(value);
-        } else if (address >= 0x10 && address <= 0x26) {
-            audio.write(address - 0x10, value);
-        } else if (address >= 0x30 && address <= 0x3f) {
-            audio.write(address - 0x30, value);
-        } else if (address == 0x46) {
-            oam_dma_transfer = value; 
-        } else if (address <= 0x4b) {
+        (this->*registers[address].write)(address, value);
+    }
+
+    uint8_t IoDispatcher::read_unmapped(uint8_t) {
+        return 0xff;
+    }
+
+    void IoDispatcher::write_unmapped(uint8_t, uint8_t) { }
+
+    uint8_t IoDispatcher::read_joypad(uint8_t) {
+        return joypad.read();
+    }
+
+    void IoDispatcher::write_joypad(uint8_t, uint8_t value) {
+        joypad.write(value);
+    }
+
+    uint8_t IoDispatcher::read_serial(uint8_t address) {
+        return serial.read(address - 0x01);
+    }
+
+    void IoDispatcher::write_serial(uint8_t address, uint8_t value) {
+        serial.write(address - 0x01, value);
+    }
+
+    uint8_t IoDispatcher::read_timer(uint8_t address) {
+        return timer.read(address - 0x04);
+    }
+
+    void IoDispatcher::write_timer(uint8_t address, uint8_t value) {
+        auto counter = timer.get_counter();
+
+        timer.write(address - 0x04, value);
+
+        // The frame sequencer is clocked by the same counter
+        if (address == 0x04) {
+            audio.reset_sequencer(counter & (0x1000 << sync.get_speed_shift()));
+        }
+    }
+
+    uint8_t IoDispatcher::read_interrupts(uint8_t) {
+        return interrupts.read();
+    }
+
+    void IoDispatcher::write_interrupts(uint8_t, uint8_t value) {
+        interrupts.write(value);
+    }
+
+    uint8_t IoDispatcher::read_audio(uint8_t address) {
+        return audio.read(address - 0x10);
+    }
+
+    void IoDispatcher::write_audio(uint8_t address, uint8_t value) {
+        audio.write(address - 0x10, value);
+    }
+
+    uint8_t IoDispatcher::read_lcd(uint8_t address) {
+        return lcd.read(address - 0x40);
+    }
+
+    void IoDispatcher::write_lcd(uint8_t address, uint8_t value) {
+        lcd.write(address - 0x40, value);
+    }
+
+    uint8_t IoDispatcher::read_oam_dma(uint8_t) {
+        return oam_dma_transfer;
+    }
+
+    // The bus, which can reach the source, runs the transfer
+    void IoDispatcher::write_oam_dma(uint8_t, uint8_t value) {
+        oam_dma_transfer = value;
+    }
+
+    uint8_t IoDispatcher::read_boot_rom(uint8_t) {
+        return boot_rom_mapping_control;
+    }
+
+    void IoDispatcher::write_boot_rom(uint8_t, uint8_t value) {
+        boot_rom_mapping_control = value;
+    }
+
+    // BCPS/BCPD and OCPS/OCPD only exist on the CGB
+    uint8_t IoDispatcher::read_palettes(uint8_t address) {
+        return cgb ? lcd.read(address - 0x40) : 0xff;
+    }
+
+    void IoDispatcher::write_palettes(uint8_t address, uint8_t value) {
+        if (cgb) {
             lcd.write(address - 0x40, value);
-        } else if (address == 0x50) {
-            boot_rom_mapping_control = value;
         }
-        
-        TODO("empty region");
+    }
+
+    void IoDispatcher::save_state(StateWriter &state) const {
+        joypad.save_state(state);
+        timer.save_state(state);
+        interrupts.save_state(state);
+        serial.save_state(state);
+        audio.save_state(state);
+        lcd.save_state(state);
+        state.put(oam_dma_transfer, boot_rom_mapping_control);
+    }
+
+    void IoDispatcher::load_state(StateReader &state) {
+        joypad.load_state(state);
+        timer.load_state(state);
+        interrupts.load_state(state);
+        serial.load_state(state);
+        audio.load_state(state);
+        lcd.load_state(state);
+        state.get(oam_dma_transfer, boot_rom_mapping_control);
     }
 }
@@ -5,21 +5,98 @@
 #include "io/interrupts.h"
 #include "io/audio.h"
 #include "io/lcd.h"
+#include "io/serial.h"
+#include "sample_ring.h"
+#include "state.h"
+#include "sync.h"
+#include "tile_cache.h"
+#include <array>
 #include <cstdint>
+#include <string>
 
 namespace emulator {
+    /*
+     * Routes 0xff00-0xff7f to the IO devices through a table indexed by
+     * register, so an access costs one indirect call wherever it lands.
+     * Registers no device answers read 0xff and ignore writes.
+     */
     class IoDispatcher {
         private:
+            using Reader = uint8_t (IoDispatcher::*)(uint8_t);
+            using Writer = void (IoDispatcher::*)(uint8_t, uint8_t);
+
+            struct Register {
+                Reader read;
+                Writer write;
+            };
+
+            static const std::array<Register, 0x80> registers;
+
+            Synchronizer &sync;
+            bool cgb;
+
+            io::Interrupts interrupts;
             io::Joypad joypad;
             io::Timer timer;
-            io::Interrupts interrupts;
+            io::Serial serial;
             io::Audio audio;
             io::LCD lcd;
 
             uint8_t oam_dma_transfer;
             uint8_t boot_rom_mapping_control;
-            
+
+            static std::array<Register, 0x80> make_registers();
+
+            // Handlers take the address relative to 0xff00
+            uint8_t read_unmapped(uint8_t address);
+            void write_unmapped(uint8_t address, uint8_t value);
+            uint8_t read_joypad(uint8_t address);
+            void write_joypad(uint8_t address, uint8_t value);
+            uint8_t read_serial(uint8_t address);
+            void write_serial(uint8_t address, uint8_t value);
+            uint8_t read_timer(uint8_t address);
+            void write_timer(uint8_t address, uint8_t value);
+            uint8_t read_interrupts(uint8_t address);
+            void write_interrupts(uint8_t address, uint8_t value);
+            uint8_t read_audio(uint8_t address);
+            void write_audio(uint8_t address, uint8_t value);
+            uint8_t read_lcd(uint8_t address);
+            void write_lcd(uint8_t address, uint8_t value);
+            uint8_t read_oam_dma(uint8_t address);
+            void write_oam_dma(uint8_t address, uint8_t value);
+            uint8_t read_boot_rom(uint8_t address);
+            void write_boot_rom(uint8_t address, uint8_t value);
+            uint8_t read_palettes(uint8_t address);
+            void write_palettes(uint8_t address, uint8_t value);
+
         public:
+            IoDispatcher(
+                Synchronizer &sync, const uint8_t *vram, const uint8_t *oam,
+                TileCache &tiles, uint8_t *framebuffer, bool cgb
+            );
+
+            void handle_event(Synchronizer::Module module);
+
+            const uint8_t *get_framebuffer() const;
+            uint64_t get_frame_count() const;
+            const uint8_t *get_palettes() const;
+            bool in_hblank() const;
+            const std::string &get_serial_output() const;
+
+            void set_buttons(const uint8_t pressed);
+
+            void set_sample_rate(uint32_t rate);
+            SampleRing &get_samples();
+
+            void set_video_enabled(bool enabled);
+            void set_audio_enabled(bool enabled);
+
+            inline io::Interrupts &get_interrupts() { return interrupts; }
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+
+            // Addresses are relative to 0xff00, up to 0x7f
             uint8_t read(const uint16_t address);
             void write(const uint16_t address, const uint8_t value);
     };
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstring>
+
+#include "ppu.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace emulator {
+    namespace {
+        /*
+         * Maps color indexes to shades through a DMG palette. count must be a
+         * multiple of 16.
+         */
+        inline void apply_palette(
+            const uint8_t *indexes, uint8_t palette, uint8_t *out, size_t count
+        ) {
+#ifdef __SSE2__
+            const __m128i shades[4] = {
+                _mm_set1_epi8(palette & 3),
+                _mm_set1_epi8((palette >> 2) & 3),
+                _mm_set1_epi8((palette >> 4) & 3),
+                _mm_set1_epi8(palette >> 6)
+            };
+
+            for (size_t i = 0; i < count; i += 16) {
+                __m128i index = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(indexes + i)
+                );
+                __m128i result = _mm_setzero_si128();
+
+                for (int color = 0; color < 4; color++) {
+                    __m128i match = _mm_cmpeq_epi8(index, _mm_set1_epi8(color));
+                    result = _mm_or_si128(
+                        result, _mm_and_si128(match, shades[color])
+                    );
+                }
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), result);
+            }
+#else
+            for (size_t i = 0; i < count; i++) {
+                out[i] = (palette >> (indexes[i] * 2)) & 3;
+            }
+#endif
+        }
+    }
+
+    PPU::PPU(
+        const uint8_t *vram, const uint8_t *oam, TileCache &tiles,
+        uint8_t *framebuffer, bool cgb
+    ) : vram(vram), oam(oam), tiles(tiles), cgb(cgb),
+        owned_framebuffer(
+            framebuffer ? nullptr : std::make_unique<uint8_t[]>(width * height)
+        ),
+        framebuffer(framebuffer ? framebuffer : owned_framebuffer.get()),
+        framebuffer_dirty{}, window_line(0) { }
+
+    /*
+     * On the DMG, clearing bit 0 blanks both background and window; on the
+     * CGB it only takes their priority over sprites away.
+     */
+    bool PPU::window_visible(const Registers &registers, uint8_t ly) const {
+        uint8_t enabled = cgb ? 0x20 : 0x21;
+
+        return (registers.lcdc & enabled) == enabled && registers.wy <= ly &&
+            registers.wx < width + 7;
+    }
+
+    /*
+     * Copies count consecutive tiles of a tile map row out of the tile cache,
+     * wrapping around the 32-tile map width. On the CGB each pixel also gets
+     * the palette of its tile in bits 2-4 and its priority in bit 7.
+     */
+    void PPU::decode_tiles(
+        const uint8_t *map, uint8_t first_column, uint8_t row,
+        bool unsigned_data, size_t count, uint8_t *out
+    ) const {
+        for (size_t i = 0; i < count; i++) {
+            uint8_t column = (first_column + i) & 31;
+            uint8_t tile = map[column];
+            size_t index = unsigned_data
+                ? tile
+                : 256 + static_cast<int8_t>(tile);
+
+            if (!cgb) {
+                std::memcpy(out + i * 8, tiles.get_row(index, row, false), 8);
+                continue;
+            }
+
+            uint8_t attributes = map[column + TileCache::bank_size];
+            uint8_t high = (attributes & 0x80) | (attributes & 0x07) << 2;
+            auto pixels = tiles.get_row(
+                index + (attributes & 0x08 ? TileCache::bank_tiles : 0),
+                attributes & 0x40 ? 7 - row : row, attributes & 0x20
+            );
+
+            for (size_t j = 0; j < 8; j++) {
+                out[i * 8 + j] = pixels[j] | high;
+            }
+        }
+    }
+
+    void PPU::render_background(
+        const Registers &registers, uint8_t ly, uint8_t *indexes
+    ) const {
+        uint8_t y = registers.scy + ly;
+        auto map = vram + (registers.lcdc & 0x08 ? 0x1c00 : 0x1800) +
+            (y >> 3) * 32;
+
+        // One extra tile covers the fine scroll, one more pads to 16 bytes
+        alignas(16) std::array<uint8_t, width + 16> buffer;
+
+        decode_tiles(
+            map, registers.scx >> 3, y & 7, registers.lcdc & 0x10,
+            buffer.size() / 8, buffer.data()
+        );
+        std::memcpy(indexes, buffer.data() + (registers.scx & 7), width);
+    }
+
+    void PPU::render_window(const Registers &registers, uint8_t *indexes) {
+        int x = registers.wx - 7;
+        auto map = vram + (registers.lcdc & 0x40 ? 0x1c00 : 0x1800) +
+            (window_line >> 3) * 32;
+
+        alignas(16) std::array<uint8_t, width + 16> buffer;
+
+        decode_tiles(
+            map, 0, window_line & 7, registers.lcdc & 0x10, buffer.size() / 8,
+            buffer.data()
+        );
+
+        if (x >= 0) {
+            std::memcpy(indexes + x, buffer.data(), width - x);
+        } else {
+            std::memcpy(indexes, buffer.data() - x, width);
+        }
+
+        window_line++;
+    }
+
+    void PPU::render_sprites(
+        const Registers &registers, uint8_t ly, const uint8_t *indexes,
+        uint8_t *line
+    ) const {
+        int sprite_height = registers.lcdc & 0x04 ? 16 : 8;
+
+        std::array<uint8_t, 10> selected;
+        size_t count = 0;
+
+        for (uint8_t i = 0; i < 40 && count < selected.size(); i++) {
+            int y = oam[i * 4] - 16;
+
+            if (ly >= y && ly < y + sprite_height) {
+                selected[count++] = i;
+            }
+        }
+
+        // Lower X wins, then lower OAM index; the CGB only looks at the index
+        if (!cgb) {
+            std::stable_sort(
+                selected.begin(), selected.begin() + count,
+                [this](uint8_t a, uint8_t b) {
+                    return oam[a * 4 + 1] < oam[b * 4 + 1];
+                }
+            );
+        }
+
+        bool background_priority = !cgb || (registers.lcdc & 0x01);
+
+        std::array<bool, width> owned{};
+
+        for (size_t s = 0; s < count; s++) {
+            auto entry = oam + selected[s] * 4;
+            int x = entry[1] - 8;
+            uint8_t tile = entry[2];
+            uint8_t attributes = entry[3];
+            int row = ly - (entry[0] - 16);
+
+            if (sprite_height == 16) {
+                tile &= 0xfe;
+            }
+
+            if (attributes & 0x40) {
+                row = sprite_height - 1 - row;
+            }
+
+            size_t bank = cgb && (attributes & 0x08)
+                ? TileCache::bank_tiles
+                : 0;
+
+            // In 8x16 mode the second half comes from the next tile
+            auto pixels = tiles.get_row(
+                bank + tile + (row >> 3), row & 7, attributes & 0x20
+            );
+            uint8_t palette = attributes & 0x10
+                ? registers.obp1
+                : registers.obp0;
+
+            for (int i = 0; i < 8; i++) {
+                int px = x + i;
+                uint8_t color = pixels[i];
+
+                if (px < 0 || px >= static_cast<int>(width) || color == 0 ||
+                    owned[px]) {
+                    continue;
+                }
+
+                owned[px] = true;
+
+                // The CGB background can also claim priority per tile
+                if ((indexes[px] & 0x03) && background_priority &&
+                    ((attributes | (cgb ? indexes[px] : 0)) & 0x80)) {
+                    continue;
+                }
+
+                line[px] = cgb
+                    ? 0x20 | (attributes & 0x07) << 2 | color
+                    : (palette >> (color * 2)) & 3;
+            }
+        }
+    }
+
+    void PPU::start_frame() {
+        window_line = 0;
+    }
+
+    void PPU::render_line(const Registers &registers, uint8_t ly) {
+        auto line = framebuffer + ly * width;
+
+        framebuffer_dirty[ly * width / state_page_size] = 1;
+        framebuffer_dirty[(ly * width + width - 1) / state_page_size] = 1;
+
+        alignas(16) std::array<uint8_t, width> indexes{};
+
+        tiles.refresh();
+
+        if (cgb || (registers.lcdc & 0x01)) {
+            render_background(registers, ly, indexes.data());
+
+            if (window_visible(registers, ly)) {
+                render_window(registers, indexes.data());
+            }
+        }
+
+        if (cgb) {
+            for (size_t i = 0; i < width; i++) {
+                line[i] = indexes[i] & 0x1f;
+            }
+        } else {
+            apply_palette(indexes.data(), registers.bgp, line, width);
+        }
+
+        if (registers.lcdc & 0x02) {
+            render_sprites(registers, ly, indexes.data(), line);
+        }
+    }
+
+    void PPU::skip_line(const Registers &registers, uint8_t ly) {
+        if (window_visible(registers, ly)) {
+            window_line++;
+        }
+    }
+
+    const uint8_t *PPU::get_framebuffer() const {
+        return framebuffer;
+    }
+
+    void PPU::save_state(StateWriter &state) const {
+        state.put_pages(
+            framebuffer, width * height, framebuffer_dirty.data()
+        );
+        state.put(window_line);
+    }
+
+    void PPU::load_state(StateReader &state) {
+        state.get_pages(
+            framebuffer, width * height, framebuffer_dirty.data()
+        );
+        state.get(window_line);
+    }
+}
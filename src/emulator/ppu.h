@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "state.h"
+#include "tile_cache.h"
+
+namespace emulator {
+    /*
+     * Scanline renderer. Draws background, window and sprites from the tile
+     * cache, the VRAM tile maps and OAM into a framebuffer of 2-bit shades
+     * (0 is the lightest).
+     *
+     * In CGB mode tiles also come from the second VRAM bank, as the
+     * attribute map there selects, and pixels are indexes into palette RAM
+     * instead: palette * 4 + color for the background, 32 more for sprites.
+     */
+    class PPU {
+        public:
+            static constexpr size_t width = 160;
+            static constexpr size_t height = 144;
+
+            /*
+             * Register values the renderer reads, latched by the LCD when a
+             * line is drawn.
+             */
+            struct Registers {
+                uint8_t lcdc;
+                uint8_t scy;
+                uint8_t scx;
+                uint8_t bgp;
+                uint8_t obp0;
+                uint8_t obp1;
+                uint8_t wy;
+                uint8_t wx;
+            };
+
+        private:
+            // Both banks on the CGB
+            const uint8_t *vram;
+            const uint8_t *oam;
+            TileCache &tiles;
+            bool cgb;
+
+            // Points to owned_framebuffer unless it was provided externally
+            std::unique_ptr<uint8_t[]> owned_framebuffer;
+            uint8_t *framebuffer;
+            // Framebuffer pages drawn since the last checkpoint
+            mutable std::array<uint8_t, width * height / state_page_size>
+                framebuffer_dirty;
+
+            uint8_t window_line;
+
+            bool window_visible(const Registers &registers, uint8_t ly) const;
+
+            void decode_tiles(
+                const uint8_t *map, uint8_t first_column, uint8_t row,
+                bool unsigned_data, size_t count, uint8_t *out
+            ) const;
+
+            void render_background(
+                const Registers &registers, uint8_t ly, uint8_t *indexes
+            ) const;
+            void render_window(
+                const Registers &registers, uint8_t *indexes
+            );
+            void render_sprites(
+                const Registers &registers, uint8_t ly, const uint8_t *indexes,
+                uint8_t *line
+            ) const;
+
+        public:
+            PPU(
+                const uint8_t *vram, const uint8_t *oam, TileCache &tiles,
+                uint8_t *framebuffer = nullptr, bool cgb = false
+            );
+
+            void start_frame();
+            void render_line(const Registers &registers, uint8_t ly);
+            // Keeps the window line counter going without drawing the line
+            void skip_line(const Registers &registers, uint8_t ly);
+
+            const uint8_t *get_framebuffer() const;
+
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
+    };
+}
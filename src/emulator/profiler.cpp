@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "profiler.h"
+
+namespace emulator {
+    namespace {
+        // bb:aaaa, the way debuggers show banked addresses
+        void write_location(std::ostream &out, uint32_t location) {
+            auto flags = out.flags();
+            auto fill = out.fill('0');
+
+            out << std::hex << std::setw(2) << (location >> 16) << ':'
+                << std::setw(4) << (location & 0xffff);
+            out.flags(flags);
+            out.fill(fill);
+        }
+
+        void write_opcode(std::ostream &out, uint16_t opcode) {
+            auto flags = out.flags();
+            auto fill = out.fill('0');
+
+            out << (opcode & 0x100 ? "cb " : "   ") << std::hex
+                << std::setw(2) << (opcode & 0xff);
+            out.flags(flags);
+            out.fill(fill);
+        }
+    }
+
+    Profiler::Profiler() {
+        clear();
+    }
+
+    const char *Profiler::to_string(Region region) {
+        switch (region) {
+            case Region::rom0: return "rom0";
+            case Region::romx: return "romx";
+            case Region::vram: return "vram";
+            case Region::cartridge_ram: return "cartridge_ram";
+            case Region::wram: return "wram";
+            case Region::echo_ram: return "echo_ram";
+            case Region::oam: return "oam";
+            case Region::unusable: return "unusable";
+            case Region::io: return "io";
+            case Region::hram: return "hram";
+            case Region::ie: return "ie";
+            case Region::num_regions: break;
+        }
+
+        return "unknown";
+    }
+
+    void Profiler::count_instruction(
+        uint32_t location, uint16_t opcode, uint64_t cycles
+    ) {
+        auto &counter = locations[location];
+
+        counter.count++;
+        counter.cycles += cycles;
+        opcodes[opcode].count++;
+        opcodes[opcode].cycles += cycles;
+        frames[current].cycles += cycles;
+    }
+
+    void Profiler::count_idle(uint64_t cycles) {
+        idle_cycles += cycles;
+        frames[current].cycles += cycles;
+    }
+
+    void Profiler::enter(uint32_t location) {
+        if (frames[current].depth == max_depth) {
+            return;
+        }
+
+        auto [child, inserted] = frames[current].children.try_emplace(
+            location, frames.size()
+        );
+        // Growing frames invalidates child
+        auto next = child->second;
+
+        if (inserted) {
+            frames.push_back({
+                location, current, frames[current].depth + 1, 0, {}
+            });
+        }
+
+        current = next;
+    }
+
+    void Profiler::leave() {
+        // Returns without a matching call, e.g. from a jump into a routine
+        if (current) {
+            current = frames[current].parent;
+        }
+    }
+
+    void Profiler::clear() {
+        locations.clear();
+        opcodes.fill({});
+        reads.fill(0);
+        writes.fill(0);
+        idle_cycles = 0;
+
+        frames.clear();
+        frames.push_back({ 0, 0, 0, 0, {} });
+        current = 0;
+    }
+
+    void Profiler::write_report(std::ostream &out, size_t top) const {
+        uint64_t total = idle_cycles;
+
+        for (auto &counter : opcodes) {
+            total += counter.cycles;
+        }
+
+        out << "cycles\t" << total << "\nidle\t" << idle_cycles << "\n\n";
+
+        std::vector<std::pair<uint32_t, Counter>> hot(
+            locations.begin(), locations.end()
+        );
+
+        std::sort(hot.begin(), hot.end(), [](auto &a, auto &b) {
+            return a.second.cycles > b.second.cycles ||
+                (a.second.cycles == b.second.cycles && a.first < b.first);
+        });
+        hot.resize(std::min(hot.size(), top));
+
+        out << "location\tcount\tcycles\n";
+
+        for (auto &[location, counter] : hot) {
+            write_location(out, location);
+            out << '\t' << counter.count << '\t' << counter.cycles << '\n';
+        }
+
+        std::vector<uint16_t> order;
+
+        for (uint16_t opcode = 0; opcode < opcodes.size(); opcode++) {
+            if (opcodes[opcode].count) {
+                order.push_back(opcode);
+            }
+        }
+
+        std::stable_sort(order.begin(), order.end(), [this](auto a, auto b) {
+            return opcodes[a].cycles > opcodes[b].cycles;
+        });
+
+        out << "\nopcode\tcount\tcycles\n";
+
+        for (auto opcode : order) {
+            write_opcode(out, opcode);
+            out << '\t' << opcodes[opcode].count << '\t'
+                << opcodes[opcode].cycles << '\n';
+        }
+
+        out << "\nregion\treads\twrites\n";
+
+        for (size_t region = 0; region < num_regions; region++) {
+            out << to_string(static_cast<Region>(region)) << '\t'
+                << reads[region] << '\t' << writes[region] << '\n';
+        }
+    }
+
+    void Profiler::write_stack(std::ostream &out, uint32_t frame) const {
+        if (!frame) {
+            out << "root";
+            return;
+        }
+
+        write_stack(out, frames[frame].parent);
+        out << ';';
+        write_location(out, frames[frame].location);
+    }
+
+    void Profiler::write_folded(std::ostream &out) const {
+        for (uint32_t frame = 0; frame < frames.size(); frame++) {
+            if (frames[frame].cycles) {
+                write_stack(out, frame);
+                out << ' ' << frames[frame].cycles << '\n';
+            }
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace emulator {
+    /*
+     * Guest code profiler. Only builds with GUB_PROFILE defined feed it (see
+     * the profile target in the Makefile); elsewhere it is compiled but never
+     * instantiated, so it costs nothing.
+     *
+     * Locations are (bank << 16 | address), where bank is the ROM bank
+     * mapped at the address, or 0 outside the switchable window. Calls and
+     * returns build a call tree, with every instruction's cycles charged to
+     * the frame it ran in, which is written out as folded stacks for
+     * flamegraph.pl and similar tools.
+     */
+    class Profiler {
+        public:
+            enum class Region: size_t {
+                rom0,
+                romx,
+                vram,
+                cartridge_ram,
+                wram,
+                echo_ram,
+                oam,
+                unusable,
+                io,
+                hram,
+                ie,
+                num_regions
+            };
+
+            struct Counter {
+                uint64_t count = 0;
+                uint64_t cycles = 0;
+            };
+
+        private:
+            static constexpr size_t num_regions =
+                std::to_underlying(Region::num_regions);
+            /*
+             * Code that never returns, such as code popping its own return
+             * address, would otherwise grow the tree without bound.
+             */
+            static constexpr size_t max_depth = 64;
+
+            struct Frame {
+                uint32_t location;
+                uint32_t parent;
+                size_t depth;
+                uint64_t cycles;
+                std::unordered_map<uint32_t, uint32_t> children;
+            };
+
+            std::unordered_map<uint32_t, Counter> locations;
+            // CB-prefixed opcodes follow the 256 base ones
+            std::array<Counter, 512> opcodes;
+            std::array<uint64_t, num_regions> reads;
+            std::array<uint64_t, num_regions> writes;
+            uint64_t idle_cycles;
+
+            // frames[0] is the root, whatever ran before the first call
+            std::vector<Frame> frames;
+            uint32_t current;
+
+            void write_stack(std::ostream &out, uint32_t frame) const;
+
+        public:
+            Profiler();
+
+            static constexpr Region get_region(uint16_t address);
+            static const char *to_string(Region region);
+
+            inline void count_read(uint16_t address) {
+                reads[std::to_underlying(get_region(address))]++;
+            }
+
+            inline void count_write(uint16_t address) {
+                writes[std::to_underlying(get_region(address))]++;
+            }
+
+            void count_instruction(
+                uint32_t location, uint16_t opcode, uint64_t cycles
+            );
+            // Time spent halted, charged to the current frame
+            void count_idle(uint64_t cycles);
+
+            void enter(uint32_t location);
+            void leave();
+
+            void clear();
+
+            /*
+             * Flat report: the hottest locations and opcodes by cycles and
+             * the access count of every memory region.
+             */
+            void write_report(std::ostream &out, size_t top = 50) const;
+            // One "frame;frame;... cycles" line per stack with self time
+            void write_folded(std::ostream &out) const;
+    };
+
+    constexpr Profiler::Region Profiler::get_region(uint16_t address) {
+        if (address < 0x4000) return Region::rom0;
+        if (address < 0x8000) return Region::romx;
+        if (address < 0xa000) return Region::vram;
+        if (address < 0xc000) return Region::cartridge_ram;
+        if (address < 0xe000) return Region::wram;
+        if (address < 0xfe00) return Region::echo_ram;
+        if (address < 0xfea0) return Region::oam;
+        if (address < 0xff00) return Region::unusable;
+        if (address < 0xff80) return Region::io;
+        if (address < 0xffff) return Region::hram;
+        return Region::ie;
+    }
+}
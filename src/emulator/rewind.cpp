@@ -0,0 +1,220 @@
+#include <cstring>
+#include <utility>
+
+#include "rewind.h"
+
+namespace emulator {
+    namespace {
+        // Equal bytes shorter than this stay inside a literal
+        constexpr size_t min_zero_run = 8;
+
+        inline uint64_t load_word(const uint8_t *data) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            return word;
+        }
+
+        inline uint8_t *put_length(uint8_t *out, size_t value) {
+            while (value >= 0x80) {
+                *out++ = static_cast<uint8_t>(value) | 0x80;
+                value >>= 7;
+            }
+
+            *out++ = static_cast<uint8_t>(value);
+            return out;
+        }
+
+        inline const uint8_t *get_length(const uint8_t *in, size_t &value) {
+            value = 0;
+
+            for (int shift = 0;; shift += 7) {
+                value |= static_cast<size_t>(*in & 0x7f) << shift;
+
+                if (!(*in++ & 0x80)) {
+                    return in;
+                }
+            }
+        }
+    }
+
+    Rewind::Rewind(CPU &cpu, const RewindOptions &options)
+        : cpu(cpu), state_size(cpu.get_state_size()), latest(state_size),
+          current(state_size), scratch(state_size * 2 + 32),
+          has_latest(false), arena(options.memory_budget), head(0),
+          entries(options.max_frames), oldest(0), count(0) { }
+
+    /*
+     * Writes the delta between two states to scratch as a sequence of
+     * tokens. Each token is a varint holding length << 1 | literal, followed
+     * by the XOR of the literal bytes; zero runs have no payload.
+     */
+    size_t Rewind::encode(const uint8_t *next, const uint8_t *previous) {
+        auto out = scratch.data();
+        size_t i = 0;
+
+        while (i < state_size) {
+            size_t start = i;
+
+            while (i + 8 <= state_size &&
+                   load_word(next + i) == load_word(previous + i)) {
+                i += 8;
+            }
+
+            while (i < state_size && next[i] == previous[i]) {
+                i++;
+            }
+
+            if (i > start) {
+                out = put_length(out, (i - start) << 1);
+            }
+
+            start = i;
+
+            while (i < state_size) {
+                if (next[i] != previous[i]) {
+                    i++;
+                    continue;
+                }
+
+                size_t run = i;
+
+                while (run < state_size && run < i + min_zero_run &&
+                       next[run] == previous[run]) {
+                    run++;
+                }
+
+                if (run - i == min_zero_run || run == state_size) {
+                    break;
+                }
+
+                i = run;
+            }
+
+            if (i > start) {
+                out = put_length(out, (i - start) << 1 | 1);
+
+                for (size_t j = start; j < i; j++) {
+                    *out++ = next[j] ^ previous[j];
+                }
+            }
+        }
+
+        return out - scratch.data();
+    }
+
+    void Rewind::apply(const Entry &entry) {
+        const uint8_t *in = arena.data() + entry.offset;
+        const uint8_t *end = in + entry.size;
+        auto state = latest.data();
+
+        while (in < end) {
+            size_t token;
+            in = get_length(in, token);
+
+            size_t length = token >> 1;
+
+            if (token & 1) {
+                for (size_t i = 0; i < length; i++) {
+                    state[i] ^= in[i];
+                }
+
+                in += length;
+            }
+
+            state += length;
+        }
+    }
+
+    /*
+     * Deltas are laid out back to back and wrap to the start of the arena
+     * when they don't fit before its end. Whatever the new delta overlaps is
+     * the oldest history, so it's dropped first.
+     */
+    uint8_t *Rewind::allocate(size_t size) {
+        if (size > arena.size() || entries.empty()) {
+            return nullptr;
+        }
+
+        if (count == entries.size()) {
+            drop_oldest();
+        }
+
+        size_t offset = head;
+
+        if (offset + size > arena.size()) {
+            // Everything between here and the end is older than the start
+            while (count && entries[oldest].offset >= head) {
+                drop_oldest();
+            }
+
+            offset = 0;
+        }
+
+        while (count && entries[oldest].offset < offset + size &&
+               entries[oldest].offset + entries[oldest].size > offset) {
+            drop_oldest();
+        }
+
+        entries[(oldest + count) % entries.size()] = { offset, size };
+        count++;
+        head = offset + size;
+
+        return arena.data() + offset;
+    }
+
+    void Rewind::drop_oldest() {
+        oldest = (oldest + 1) % entries.size();
+        count--;
+    }
+
+    void Rewind::record() {
+        cpu.save_state(current.data());
+
+        if (has_latest) {
+            size_t size = encode(current.data(), latest.data());
+            auto slot = allocate(size);
+
+            if (slot) {
+                std::memcpy(slot, scratch.data(), size);
+            } else {
+                // Too large for the budget: start over from this frame
+                clear();
+            }
+        }
+
+        std::swap(latest, current);
+        has_latest = true;
+    }
+
+    bool Rewind::step_back() {
+        if (!count) {
+            return false;
+        }
+
+        auto &entry = entries[(oldest + count - 1) % entries.size()];
+
+        apply(entry);
+        head = entry.offset;
+        count--;
+
+        // The state came from this CPU, so loading it can't fail
+        (void) cpu.load_state(latest.data(), state_size);
+
+        return true;
+    }
+
+    void Rewind::clear() {
+        head = 0;
+        oldest = 0;
+        count = 0;
+    }
+
+    size_t Rewind::get_frame_count() const {
+        return count;
+    }
+
+    size_t Rewind::get_memory_usage() const {
+        return latest.size() + current.size() + scratch.size() +
+            arena.size() + entries.size() * sizeof(Entry);
+    }
+}
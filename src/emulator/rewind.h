@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpu.h"
+
+namespace emulator {
+    struct RewindOptions {
+        // Frames of history kept, e.g. 60 per second of rewind
+        size_t max_frames = 600;
+        // Bytes reserved for compressed history; never grows past this
+        size_t memory_budget = 16 * 1024 * 1024;
+    };
+
+    /*
+     * Frame history for stepping backwards. Only the newest state is kept in
+     * full. Every recorded frame stores the XOR of its state against the
+     * previous one, run-length encoded (consecutive states are mostly equal,
+     * so their XOR is mostly zero runs). Stepping back XORs the newest delta
+     * into the newest state, so each step costs one delta regardless of how
+     * much history there is.
+     *
+     * Deltas live in a ring buffer allocated up front; when it, or the frame
+     * limit, runs out, the oldest frames are dropped.
+     */
+    class Rewind {
+        private:
+            struct Entry {
+                size_t offset;
+                size_t size;
+            };
+
+            CPU &cpu;
+
+            size_t state_size;
+            std::vector<uint8_t> latest;
+            std::vector<uint8_t> current;
+            std::vector<uint8_t> scratch;
+            bool has_latest;
+
+            std::vector<uint8_t> arena;
+            size_t head;
+
+            std::vector<Entry> entries;
+            size_t oldest;
+            size_t count;
+
+            size_t encode(const uint8_t *next, const uint8_t *previous);
+            void apply(const Entry &entry);
+
+            uint8_t *allocate(size_t size);
+            void drop_oldest();
+
+        public:
+            Rewind(CPU &cpu, const RewindOptions &options = {});
+
+            // Adds the CPU's current state to the history, once per frame
+            void record();
+
+            /*
+             * Restores the CPU to the previously recorded frame. Returns false
+             * once the history is exhausted.
+             */
+            bool step_back();
+
+            void clear();
+
+            size_t get_frame_count() const;
+
+            // Everything allocated by the history, fixed at construction
+            size_t get_memory_usage() const;
+    };
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace emulator {
+    /*
+     * Lock-free single-producer single-consumer queue of interleaved stereo
+     * 16-bit frames. The emulation thread pushes, an audio callback pops;
+     * each side only writes its own index, so neither ever waits. Frames
+     * that don't fit are dropped rather than blocking emulation.
+     */
+    class SampleRing {
+        public:
+            // Frames, a power of two; about 170 ms at 48 kHz
+            static constexpr size_t capacity = 8192;
+
+        private:
+            static constexpr size_t mask = capacity - 1;
+
+            std::unique_ptr<int16_t[]> samples;
+
+            // Indexes grow forever and wrap through mask
+            alignas(64) std::atomic<size_t> head;
+            alignas(64) std::atomic<size_t> tail;
+
+        public:
+            SampleRing()
+                : samples(std::make_unique<int16_t[]>(capacity * 2)), head(0),
+                  tail(0) { }
+
+            // Frames ready to pop
+            inline size_t size() const {
+                return tail.load(std::memory_order_acquire) -
+                    head.load(std::memory_order_acquire);
+            }
+
+            // Producer side; returns how many frames were queued
+            inline size_t push(const int16_t *frames, size_t count) {
+                auto end = tail.load(std::memory_order_relaxed);
+                auto start = head.load(std::memory_order_acquire);
+
+                count = std::min(count, capacity - (end - start));
+
+                for (size_t i = 0; i < count; i++) {
+                    auto slot = (end + i) & mask;
+
+                    samples[slot * 2] = frames[i * 2];
+                    samples[slot * 2 + 1] = frames[i * 2 + 1];
+                }
+
+                tail.store(end + count, std::memory_order_release);
+
+                return count;
+            }
+
+            // Consumer side; returns how many frames were read
+            inline size_t pop(int16_t *frames, size_t count) {
+                auto start = head.load(std::memory_order_relaxed);
+                auto end = tail.load(std::memory_order_acquire);
+
+                count = std::min(count, end - start);
+
+                for (size_t i = 0; i < count; i++) {
+                    auto slot = (start + i) & mask;
+
+                    frames[i * 2] = samples[slot * 2];
+                    frames[i * 2 + 1] = samples[slot * 2 + 1];
+                }
+
+                head.store(start + count, std::memory_order_release);
+
+                return count;
+            }
+    };
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace emulator {
+    /*
+     * Save states have a fixed layout: a header, then the fields of every
+     * module in a fixed order, each copied as raw bytes. The layout depends
+     * only on the emulator version and the cartridge RAM size, so a buffer
+     * sized once can take any number of snapshots.
+     */
+    struct StateHeader {
+        std::array<char, 4> magic;
+        uint32_t version;
+        uint64_t size;
+    };
+
+    constexpr std::array<char, 4> state_magic = { 'G', 'U', 'B', 'S' };
+    // Bump whenever a module adds, removes or reorders saved fields
+    constexpr uint32_t state_version = 7;
+
+    /*
+     * Large memories are tracked in pages: whoever writes to them sets the
+     * page's dirty flag, and incremental snapshots store only dirty pages.
+     * Paged memory sizes must be multiples of the page size.
+     */
+    constexpr size_t state_page_size = 0x100;
+
+    /*
+     * Pages captured by an incremental snapshot. Pages are numbered across
+     * every paged memory in save order.
+     */
+    struct PageSet {
+        std::vector<uint32_t> indexes;
+        std::vector<uint8_t> data;
+    };
+
+    /*
+     * Appends fields to a caller-provided buffer. Without a buffer it only
+     * counts bytes, which is how the state size is measured.
+     *
+     * With a PageSet, paged memories don't go to the buffer: their dirty
+     * pages (or all of them, for a snapshot with no parent) go to the set
+     * and the dirty flags are cleared.
+     */
+    class StateWriter {
+        private:
+            uint8_t *buffer;
+            size_t offset;
+
+            PageSet *pages;
+            bool all_pages;
+            uint32_t page_index;
+            size_t paged_size;
+
+        public:
+            explicit StateWriter(
+                uint8_t *buffer = nullptr, PageSet *pages = nullptr,
+                bool all_pages = false
+            ) : buffer(buffer), offset(0), pages(pages), all_pages(all_pages),
+                page_index(0), paged_size(0) { }
+
+            inline size_t get_size() const { return offset; }
+            inline size_t get_paged_size() const { return paged_size; }
+
+            inline void skip(size_t size) { offset += size; }
+
+            inline void put_bytes(const void *data, size_t size) {
+                if (buffer && size) {
+                    std::memcpy(buffer + offset, data, size);
+                }
+
+                offset += size;
+            }
+
+            template <typename... T>
+            inline void put(const T &...values) {
+                static_assert((std::is_trivially_copyable_v<T> && ...));
+                (put_bytes(&values, sizeof(T)), ...);
+            }
+
+            inline void put_pages(
+                const uint8_t *data, size_t size, uint8_t *dirty
+            ) {
+                paged_size += size;
+
+                if (!pages) {
+                    put_bytes(data, size);
+                    return;
+                }
+
+                for (size_t i = 0; i < size / state_page_size; i++) {
+                    if (all_pages || dirty[i]) {
+                        auto page = data + i * state_page_size;
+
+                        pages->indexes.push_back(page_index + i);
+                        pages->data.insert(
+                            pages->data.end(), page, page + state_page_size
+                        );
+                        dirty[i] = 0;
+                    }
+                }
+
+                page_index += size / state_page_size;
+            }
+    };
+
+    /*
+     * Reads fields back in the order StateWriter wrote them. Given the
+     * source of every page, paged memories are gathered from there instead
+     * and come out clean.
+     */
+    class StateReader {
+        private:
+            const uint8_t *buffer;
+            size_t offset;
+
+            const uint8_t *const *page_sources;
+            uint32_t page_index;
+
+        public:
+            explicit StateReader(
+                const uint8_t *buffer,
+                const uint8_t *const *page_sources = nullptr
+            ) : buffer(buffer), offset(0), page_sources(page_sources),
+                page_index(0) { }
+
+            inline void get_bytes(void *data, size_t size) {
+                if (size) {
+                    std::memcpy(data, buffer + offset, size);
+                }
+
+                offset += size;
+            }
+
+            template <typename... T>
+            inline void get(T &...values) {
+                static_assert((std::is_trivially_copyable_v<T> && ...));
+                (get_bytes(&values, sizeof(T)), ...);
+            }
+
+            inline void get_pages(uint8_t *data, size_t size, uint8_t *dirty) {
+                if (!page_sources) {
+                    get_bytes(data, size);
+                    return;
+                }
+
+                for (size_t i = 0; i < size / state_page_size; i++) {
+                    std::memcpy(
+                        data + i * state_page_size, page_sources[page_index++],
+                        state_page_size
+                    );
+                    dirty[i] = 0;
+                }
+            }
+    };
+}
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+#include "step_buffer.h"
+
+namespace emulator {
+    const StepBuffer::Kernel StepBuffer::kernel = StepBuffer::make_kernel();
+
+    /*
+     * One row of taps per sub-sample phase: a Blackman-windowed sinc, cut
+     * off a little below the output Nyquist frequency, delayed by half the
+     * kernel width and shifted by the phase. Every row is normalized so a
+     * step always ends exactly at its full height.
+     */
+    StepBuffer::Kernel StepBuffer::make_kernel() {
+        constexpr double cutoff = 0.9;
+        constexpr double half = width / 2.0;
+
+        Kernel result;
+
+        for (size_t phase = 0; phase < phases; phase++) {
+            std::array<double, width> taps;
+            double sum = 0;
+
+            for (size_t i = 0; i < width; i++) {
+                double t = i - half + 1 - double(phase) / phases;
+                double x = std::numbers::pi * cutoff * t;
+                double sinc = t == 0 ? 1 : std::sin(x) / x;
+                double w = (t + half) / width;
+                double window = 0.42 - 0.5 * std::cos(2 * std::numbers::pi * w) +
+                    0.08 * std::cos(4 * std::numbers::pi * w);
+
+                taps[i] = std::max(0.0, window) * sinc;
+                sum += taps[i];
+            }
+
+            int32_t total = 0;
+
+            for (size_t i = 0; i < width; i++) {
+                result[phase][i] = std::lround(
+                    taps[i] / sum * (1 << unity_bits)
+                );
+                total += result[phase][i];
+            }
+
+            // Rounding error goes to the center tap
+            result[phase][width / 2 - 1] += (1 << unity_bits) - total;
+        }
+
+        return result;
+    }
+
+    StepBuffer::StepBuffer(uint32_t sample_rate) {
+        reset(sample_rate, 0);
+    }
+
+    void StepBuffer::reset(uint32_t sample_rate, uint64_t time) {
+        factor = (uint64_t(sample_rate) << 32) / clock_rate;
+        offset = 0;
+        base_time = time;
+        deltas.fill(0);
+        integrator = 0;
+        high_pass = 0;
+    }
+
+    void StepBuffer::end_frame(uint64_t time) {
+        offset = std::min(
+            offset + (time - base_time) * factor, uint64_t(capacity) << 32
+        );
+        base_time = time;
+    }
+
+    size_t StepBuffer::get_available() const {
+        return offset >> 32;
+    }
+
+    size_t StepBuffer::read(int16_t *out, size_t count, size_t stride) {
+        count = std::min(count, get_available());
+
+        for (size_t i = 0; i < count; i++) {
+            integrator += deltas[i];
+
+            int32_t sample = integrator >> unity_bits;
+            int32_t filtered = sample - (high_pass >> high_pass_bits);
+
+            high_pass += filtered;
+            out[i * stride] = std::clamp<int32_t>(filtered, -32768, 32767);
+        }
+
+        // Keep the kernel tails of steps past the samples read
+        size_t kept = (offset >> 32) - count + width;
+
+        std::memmove(
+            deltas.data(), deltas.data() + count, kept * sizeof(int32_t)
+        );
+        // Everything past what was moved down is still zero
+        std::fill_n(deltas.begin() + kept, count, 0);
+        offset -= uint64_t(count) << 32;
+
+        return count;
+    }
+}
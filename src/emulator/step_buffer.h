@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace emulator {
+    /*
+     * Band-limited step synthesis for one output channel. Sound generators
+     * only report when and by how much their level changes; each change is
+     * added to a buffer at the output sample rate as a windowed-sinc step,
+     * positioned with sub-sample precision, and the buffer is integrated
+     * when read. That resamples from the T-cycle clock to the output rate
+     * with no aliasing and at a cost proportional to the number of changes
+     * rather than to the number of cycles.
+     */
+    class StepBuffer {
+        public:
+            static constexpr uint32_t clock_rate = 4194304;
+            // Output samples the buffer holds between reads
+            static constexpr size_t capacity = 4096;
+
+        private:
+            static constexpr int phase_bits = 5;
+            static constexpr size_t phases = 1 << phase_bits;
+            static constexpr size_t width = 16;
+            // Kernel taps add up to 1 << unity_bits
+            static constexpr int unity_bits = 15;
+            // The high-pass filter follows the DC level in about 2^9 samples
+            static constexpr int high_pass_bits = 9;
+
+            using Kernel = std::array<std::array<int32_t, width>, phases>;
+
+            static const Kernel kernel;
+
+            // Output samples per cycle, as 32.32 fixed point
+            uint64_t factor;
+            // Position of base_time in the buffer, as 32.32 fixed point
+            uint64_t offset;
+            uint64_t base_time;
+
+            std::array<int32_t, capacity + width> deltas;
+            int32_t integrator;
+            int32_t high_pass;
+
+            static Kernel make_kernel();
+
+        public:
+            StepBuffer(uint32_t sample_rate);
+
+            // Empties the buffer, starting it at time
+            void reset(uint32_t sample_rate, uint64_t time);
+
+            /*
+             * Changes the level by delta at time, which must not be before
+             * the last end_frame. Changes past the end of the buffer are
+             * dropped.
+             */
+            inline void add_delta(uint64_t time, int32_t delta) {
+                auto position = offset + (time - base_time) * factor;
+                auto index = position >> 32;
+
+                if (index >= capacity) [[unlikely]] {
+                    return;
+                }
+
+                auto phase = (position >> (32 - phase_bits)) & (phases - 1);
+                auto &taps = kernel[phase];
+
+                for (size_t i = 0; i < width; i++) {
+                    deltas[index + i] += taps[i] * delta;
+                }
+            }
+
+            // Makes the samples before time available for reading
+            void end_frame(uint64_t time);
+            size_t get_available() const;
+
+            /*
+             * Reads up to count samples into out, every stride elements, and
+             * returns how many were read.
+             */
+            size_t read(int16_t *out, size_t count, size_t stride = 1);
+    };
+}
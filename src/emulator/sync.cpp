@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <utility>
+
+#include "sync.h"
+
+namespace emulator {
+    Synchronizer::Synchronizer()
+        : now(0), limit(never), speed_shift(0), cpu_anchor(0), now_anchor(0),
+          deadline(never), next_module(Module::num_modules) {
+        last_sync.fill(0);
+        next_event.fill(never);
+    }
+
+    void Synchronizer::update_deadline() {
+        auto earliest = std::min_element(next_event.begin(), next_event.end());
+
+        next_module = *earliest == never
+            ? Module::num_modules
+            : static_cast<Module>(earliest - next_event.begin());
+        deadline = std::min(limit, *earliest);
+    }
+
+    void Synchronizer::set_limit(uint64_t time) {
+        limit = time;
+        update_deadline();
+    }
+
+    uint64_t Synchronizer::to_time(uint64_t cpu_time) const {
+        if (cpu_time == never) {
+            return never;
+        }
+
+        auto step = (uint64_t(1) << speed_shift) - 1;
+
+        return now_anchor + ((cpu_time - cpu_anchor + step) >> speed_shift);
+    }
+
+    void Synchronizer::set_double_speed(bool enabled) {
+        cpu_anchor = get_cpu_time();
+        now_anchor = now;
+        speed_shift = enabled;
+    }
+
+    void Synchronizer::set_next_event(Module module, uint64_t time) {
+        next_event[std::to_underlying(module)] = time;
+        update_deadline();
+    }
+
+    Synchronizer::Module Synchronizer::pop_due_event() {
+        if (next_module == Module::num_modules ||
+            next_event[std::to_underlying(next_module)] > now) {
+            return Module::num_modules;
+        }
+
+        auto module = next_module;
+        set_next_event(module, never);
+        return module;
+    }
+
+    uint64_t Synchronizer::catch_up(Module module) {
+        auto index = std::to_underlying(module);
+        auto elapsed = now - last_sync[index];
+        last_sync[index] = now;
+        return elapsed;
+    }
+
+    void Synchronizer::save_state(StateWriter &state) const {
+        state.put(
+            now, speed_shift, cpu_anchor, now_anchor, last_sync, next_event
+        );
+    }
+
+    void Synchronizer::load_state(StateReader &state) {
+        state.get(
+            now, speed_shift, cpu_anchor, now_anchor, last_sync, next_event
+        );
+        update_deadline();
+    }
+}
@@ -3,25 +3,99 @@
 #include <array>
 #include <cstdint>
 #include <cstdlib>
+#include <limits>
 #include <utility>
 
+#include "state.h"
+
 namespace emulator {
+    /*
+     * Keeps the emulated clock (in T-cycles) and the deadline of every
+     * module's next event. The CPU runs uninterrupted until the earliest
+     * deadline; modules only do work when their event fires or when the bus
+     * touches one of their registers, at which point they catch up on the
+     * cycles elapsed since their last sync.
+     *
+     * The clock always counts single-speed T-cycles. In CGB double speed
+     * mode the CPU, and the timer it drives, run twice as fast: CPU time is
+     * derived from the clock, anchored at the last speed switch, so ticking
+     * costs the same at either speed.
+     */
     class Synchronizer {
         public:
             enum class Module: size_t {
                 timer,
+                lcd,
+                cartridge,
+                audio,
+                oam_dma,
                 num_modules
             };
 
+            static constexpr uint64_t never =
+                std::numeric_limits<uint64_t>::max();
+
         private:
 
-            static constexpr size_t num_modules = 
+            static constexpr size_t num_modules =
                 std::to_underlying(Module::num_modules);
 
-            std::array<uint32_t, num_modules> last_sync; 
-            std::array<uint32_t, num_modules> next_event; 
+            uint64_t now;
+            uint64_t limit;
+            // 1 in double speed mode
+            uint8_t speed_shift;
+            // CPU time at the clock time of the last speed switch
+            uint64_t cpu_anchor;
+            uint64_t now_anchor;
+
+            uint64_t deadline;
+            Module next_module;
+
+            std::array<uint64_t, num_modules> last_sync;
+            std::array<uint64_t, num_modules> next_event;
+
+            void update_deadline();
 
         public:
-            void set_next_event(Module module, uint32_t time);
+            Synchronizer();
+
+            inline uint64_t get_now() const { return now; }
+            inline void tick(uint64_t cycles) { now += cycles; }
+
+            inline uint8_t get_speed_shift() const { return speed_shift; }
+            // Advances the clock by cycles of the CPU's own clock
+            inline void tick_cpu(uint64_t cycles) {
+                now += cycles >> speed_shift;
+            }
+
+            inline uint64_t get_cpu_time() const {
+                return cpu_anchor + ((now - now_anchor) << speed_shift);
+            }
+
+            // The first clock time at or after a CPU time; never stays never
+            uint64_t to_time(uint64_t cpu_time) const;
+            void set_double_speed(bool enabled);
+
+            inline uint64_t get_deadline() const { return deadline; }
+            inline bool reached_deadline() const { return now >= deadline; }
+
+            void set_limit(uint64_t time);
+            void set_next_event(Module module, uint64_t time);
+
+            /*
+             * Returns the module whose event is due, removing the event, or
+             * Module::num_modules when nothing is due yet.
+             */
+            Module pop_due_event();
+
+            /*
+             * Returns how many cycles passed since the module last synced and
+             * marks it as synced up to now.
+             */
+            uint64_t catch_up(Module module);
+
+            // The limit belongs to the caller of run and isn't saved
+            void save_state(StateWriter &state) const;
+            void load_state(StateReader &state);
     };
 }
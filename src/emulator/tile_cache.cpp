@@ -0,0 +1,93 @@
+#include <cstring>
+
+#include "tile_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace emulator {
+    namespace {
+        /*
+         * Decodes two tile rows (low and high bitplanes) into sixteen 2-bit
+         * color indexes, leftmost pixel first.
+         */
+        inline void decode_row_pair(
+            uint8_t lo0, uint8_t hi0, uint8_t lo1, uint8_t hi1, uint8_t *out
+        ) {
+#ifdef __SSE2__
+            constexpr uint64_t spread = 0x0101010101010101;
+
+            const __m128i bits = _mm_set_epi8(
+                1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128
+            );
+            const __m128i one = _mm_set1_epi8(1);
+            const __m128i two = _mm_set1_epi8(2);
+
+            __m128i lo = _mm_set_epi64x(lo1 * spread, lo0 * spread);
+            __m128i hi = _mm_set_epi64x(hi1 * spread, hi0 * spread);
+
+            __m128i lo_set = _mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits);
+            __m128i hi_set = _mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits);
+
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(out),
+                _mm_or_si128(
+                    _mm_and_si128(lo_set, one), _mm_and_si128(hi_set, two)
+                )
+            );
+#else
+            for (int i = 0; i < 8; i++) {
+                out[i] = ((lo0 >> (7 - i)) & 1) | (((hi0 >> (7 - i)) & 1) << 1);
+                out[i + 8] =
+                    ((lo1 >> (7 - i)) & 1) | (((hi1 >> (7 - i)) & 1) << 1);
+            }
+#endif
+        }
+    }
+
+    TileCache::TileCache(const uint8_t *vram) : vram(vram) {
+        invalidate_all();
+    }
+
+    void TileCache::invalidate_all() {
+        dirty.fill(~uint64_t(0));
+    }
+
+    void TileCache::decode(size_t tile) {
+        auto data = vram + tile / bank_tiles * bank_size +
+            tile % bank_tiles * 16;
+        auto &decoded = tiles[tile];
+
+        for (size_t row = 0; row < 8; row += 2) {
+            decode_row_pair(
+                data[row * 2], data[row * 2 + 1],
+                data[row * 2 + 2], data[row * 2 + 3],
+                decoded.data() + row * 8
+            );
+        }
+
+        // Pixels are one byte each, so mirroring a row is a byte swap
+        for (size_t row = 0; row < 8; row++) {
+            uint64_t pixels;
+            std::memcpy(&pixels, decoded.data() + row * 8, 8);
+            pixels = __builtin_bswap64(pixels);
+            std::memcpy(flipped[tile].data() + row * 8, &pixels, 8);
+        }
+    }
+
+    void TileCache::refresh() {
+        for (size_t word = 0; word < dirty.size(); word++) {
+            while (dirty[word]) {
+                auto bit = __builtin_ctzll(dirty[word]);
+                dirty[word] &= dirty[word] - 1;
+
+                size_t tile = word * 64 + bit;
+
+                if (tile < num_tiles) {
+                    decode(tile);
+                }
+            }
+        }
+    }
+}
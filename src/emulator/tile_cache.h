@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace emulator {
+    /*
+     * Pre-decoded copies of the 384 tiles in each VRAM bank, as 8x8 bytes of
+     * 2-bit color indexes plus a horizontally flipped variant. Tiles of the
+     * second bank, which only the CGB has, follow those of the first. The
+     * bus marks a tile dirty whenever its data is written, and only dirty
+     * tiles are decoded again before the next line is rendered.
+     */
+    class TileCache {
+        public:
+            static constexpr size_t bank_tiles = 384;
+            static constexpr size_t num_tiles = bank_tiles * 2;
+            static constexpr size_t bank_size = 0x2000;
+
+        private:
+            using Tile = std::array<uint8_t, 64>;
+
+            const uint8_t *vram;
+
+            alignas(16) std::array<Tile, num_tiles> tiles;
+            alignas(16) std::array<Tile, num_tiles> flipped;
+
+            std::array<uint64_t, (num_tiles + 63) / 64> dirty;
+
+            void decode(size_t tile);
+
+        public:
+            TileCache(const uint8_t *vram);
+
+            /*
+             * Offset is relative to the start of VRAM, with the second bank
+             * right after the first.
+             */
+            inline void invalidate(uint16_t offset) {
+                size_t tile = offset / bank_size * bank_tiles +
+                    (offset % bank_size >> 4);
+                dirty[tile >> 6] |= uint64_t(1) << (tile & 63);
+            }
+
+            // Forces every tile to be decoded again, e.g. after VRAM is restored
+            void invalidate_all();
+
+            void refresh();
+
+            inline const uint8_t *get_row(
+                size_t tile, uint8_t row, bool flip
+            ) const {
+                return (flip ? flipped : tiles)[tile].data() + row * 8;
+            }
+    };
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+
+#include "vec_emulator.h"
+
+namespace emulator {
+    VecEmulator::VecEmulator(std::vector<Cartridge> cartridges, size_t threads)
+        : count(cartridges.size()), threads(threads),
+          wram(std::make_unique<uint8_t[]>(count * Bus::wram_size)),
+          framebuffers(std::make_unique<uint8_t[]>(count * framebuffer_size)),
+          cartridges(std::move(cartridges)), faults(count), buttons(nullptr),
+          generation(0), pending(0), stopping(false) {
+        cpus.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            ExternalMemory memory;
+            memory.wram = wram.get() + i * Bus::wram_size;
+            memory.framebuffer = framebuffers.get() + i * framebuffer_size;
+
+            cpus.push_back(std::make_unique<CPU>(this->cartridges[i], memory));
+            // Only memory and framebuffers are exposed, never samples
+            cpus.back()->set_audio_enabled(false);
+        }
+
+        for (size_t worker = 1; worker < threads; worker++) {
+            workers.emplace_back([this, worker] { work(worker); });
+        }
+    }
+
+    std::expected<std::unique_ptr<VecEmulator>, GameBoyError>
+    VecEmulator::open(const char *path, size_t count, size_t threads) {
+        if (!threads) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // Instances never write back to the save file
+        SaveOptions options;
+        options.mode = SaveOptions::Mode::copy_on_write;
+
+        std::vector<Cartridge> cartridges;
+        cartridges.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            auto cartridge = Cartridge::open(path, options);
+
+            if (!cartridge) {
+                return std::unexpected(cartridge.error());
+            }
+
+            cartridges.push_back(std::move(*cartridge));
+        }
+
+        threads = std::clamp<size_t>(threads, 1, std::max<size_t>(count, 1));
+
+        return std::unique_ptr<VecEmulator>(
+            new VecEmulator(std::move(cartridges), threads)
+        );
+    }
+
+    VecEmulator::~VecEmulator() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+
+        start.notify_all();
+    }
+
+    void VecEmulator::run_range(size_t worker) {
+        size_t first = worker * count / threads;
+        size_t last = (worker + 1) * count / threads;
+
+        for (size_t i = first; i < last; i++) {
+            if (faults[i]) {
+                continue;
+            }
+
+            if (buttons) {
+                cpus[i]->set_buttons(buttons[i]);
+            }
+
+            auto result = cpus[i]->run(frame_cycles);
+
+            if (!result) {
+                faults[i] = result.error();
+            }
+        }
+    }
+
+    void VecEmulator::work(size_t worker) {
+        uint64_t seen = 0;
+
+        while (true) {
+            {
+                std::unique_lock lock(mutex);
+                start.wait(lock, [&] { return stopping || generation != seen; });
+
+                if (stopping) {
+                    return;
+                }
+
+                seen = generation;
+            }
+
+            run_range(worker);
+
+            {
+                std::lock_guard lock(mutex);
+
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+    }
+
+    size_t VecEmulator::size() const {
+        return count;
+    }
+
+    void VecEmulator::step(const uint8_t *buttons) {
+        this->buttons = buttons;
+
+        {
+            std::lock_guard lock(mutex);
+            generation++;
+            pending = workers.size();
+        }
+
+        start.notify_all();
+        run_range(0);
+
+        std::unique_lock lock(mutex);
+        done.wait(lock, [&] { return pending == 0; });
+    }
+
+    const uint8_t *VecEmulator::get_framebuffers() const {
+        return framebuffers.get();
+    }
+
+    const uint8_t *VecEmulator::get_wram() const {
+        return wram.get();
+    }
+
+    std::optional<GameBoyError> VecEmulator::get_fault(size_t instance) const {
+        return faults[instance];
+    }
+
+    CPU &VecEmulator::get_instance(size_t instance) {
+        return *cpus[instance];
+    }
+}
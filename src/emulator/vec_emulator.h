@@ -0,0 +1,96 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "cartridge.hpp"
+#include "cpu.h"
+#include "defs.h"
+
+namespace emulator {
+    /*
+     * N instances of the same ROM stepped in lockstep, one frame at a time.
+     *
+     * WRAM and framebuffers of all instances live in two contiguous arrays,
+     * instance after instance, so they can be handed out as a whole without
+     * copying. The ROM is mapped once per instance from the same file, so
+     * every instance reads the same page cache pages; cartridge RAM is
+     * private to each instance.
+     *
+     * Instances are split into fixed contiguous ranges, one per thread of a
+     * pool that lives as long as the VecEmulator; the calling thread steps
+     * the first range itself.
+     */
+    class VecEmulator {
+        public:
+            static constexpr uint64_t frame_cycles = 70224;
+            static constexpr size_t framebuffer_size = PPU::width * PPU::height;
+
+        private:
+            size_t count;
+            size_t threads;
+
+            std::unique_ptr<uint8_t[]> wram;
+            std::unique_ptr<uint8_t[]> framebuffers;
+
+            std::vector<Cartridge> cartridges;
+            std::vector<std::unique_ptr<CPU>> cpus;
+            std::vector<std::optional<GameBoyError>> faults;
+
+            const uint8_t *buttons;
+
+            std::mutex mutex;
+            std::condition_variable start;
+            std::condition_variable done;
+            uint64_t generation;
+            size_t pending;
+            bool stopping;
+
+            // Last, so the workers are joined before anything they use goes
+            std::vector<std::jthread> workers;
+
+            VecEmulator(std::vector<Cartridge> cartridges, size_t threads);
+
+            void run_range(size_t worker);
+            void work(size_t worker);
+
+        public:
+            /*
+             * Opens count instances of the ROM at path, stepped by up to
+             * threads threads (all cores when 0).
+             */
+            static std::expected<std::unique_ptr<VecEmulator>, GameBoyError>
+                open(const char *path, size_t count, size_t threads = 0);
+
+            ~VecEmulator();
+
+            VecEmulator(const VecEmulator &) = delete;
+            VecEmulator &operator=(const VecEmulator &) = delete;
+
+            size_t size() const;
+
+            /*
+             * Runs every instance for one frame. buttons holds one set of
+             * pressed buttons per instance (see io::Joypad), or is null to
+             * keep the previous ones. Instances that faulted stay stopped.
+             */
+            void step(const uint8_t *buttons = nullptr);
+
+            // size() framebuffers of framebuffer_size bytes, back to back
+            const uint8_t *get_framebuffers() const;
+            // size() WRAMs of Bus::wram_size bytes, back to back
+            const uint8_t *get_wram() const;
+
+            std::optional<GameBoyError> get_fault(size_t instance) const;
+
+            // For per-instance work such as save states
+            CPU &get_instance(size_t instance);
+    };
+}